@@ -0,0 +1,566 @@
+#include "guilt/annotated.h"
+#include "guilt/priority_context.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory_resource>
+#include <numeric>
+#include <random>
+
+// Prints one JSON object per line:
+//     { "benchmark": "<name>", "param": <size>, "iterations": <n>, "ns_per_op": <time> }
+// Pass a substring as the only argument to run just the benchmarks whose name contains it.
+//
+// Built with GUILT_DISABLE_ANNOTATIONS defined, chain_annotated_task measures the annotated coroutine with
+// its annotations compiled out, and should be on par with chain_plain_task.
+
+#ifdef GUILT_DISABLE_ANNOTATIONS
+static_assert(std::is_same_v<guilt::annotated_task<int>, guilt::task<int>>);
+#endif
+
+namespace
+{
+const char * benchmark_filter = nullptr;
+
+template<typename T>
+void do_not_optimize(T && value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Runs body(iterations) with a growing iteration count until a run takes long enough to be measured, then
+// reports the time per operation of that run. body returns the number of operations it performed.
+template<typename F>
+void run(const char * name, std::size_t param, F && body)
+{
+    if (benchmark_filter && !std::strstr(name, benchmark_filter))
+    {
+        return;
+    }
+
+    using clock = std::chrono::steady_clock;
+    constexpr auto min_duration = std::chrono::milliseconds(200);
+
+    std::size_t iterations = 1;
+    while (true)
+    {
+        auto start = clock::now();
+        std::size_t operations = body(iterations);
+        auto elapsed = clock::now() - start;
+
+        if (elapsed >= min_duration || iterations >= (std::size_t(1) << 30))
+        {
+            auto ns = std::chrono::duration<double, std::nano>(elapsed).count();
+            std::cout << "{ \"benchmark\": \"" << name << "\", \"param\": " << param
+                      << ", \"iterations\": " << operations << ", \"ns_per_op\": " << ns / operations << " }"
+                      << std::endl;
+            return;
+        }
+
+        iterations *= 2;
+    }
+}
+
+void drain()
+{
+    guilt::global_execution_context().handle_all();
+}
+
+guilt::task<int> value_task(int i)
+{
+    co_return i;
+}
+
+guilt::task<int> await_value(guilt::task<int> & awaited)
+{
+    co_return co_await awaited;
+}
+
+template<std::size_t... Is>
+guilt::task<int> fan_in(std::index_sequence<Is...>)
+{
+    auto values = co_await guilt::when_all(value_task(Is)...);
+    co_return std::apply([](auto... vs) { return (vs + ... + 0); }, values);
+}
+
+guilt::task<int> fan_in_range(std::size_t width)
+{
+    std::vector<guilt::task<int>> tasks;
+    tasks.reserve(width);
+    for (std::size_t i = 0; i < width; ++i)
+    {
+        tasks.push_back(value_task(i));
+    }
+
+    auto values = co_await guilt::when_all(std::move(tasks));
+    co_return std::accumulate(values.begin(), values.end(), 0);
+}
+
+guilt::task<int> plain_chain(int depth)
+{
+    if (depth == 0)
+    {
+        co_return 0;
+    }
+    co_return 1 + co_await plain_chain(depth - 1);
+}
+
+// Coroutines whose parameters start with std::allocator_arg and an allocator have their frames allocated
+// with it, instead of from the frame pool.
+guilt::task<int> pmr_chain(std::allocator_arg_t, std::pmr::polymorphic_allocator<> alloc, int depth)
+{
+    if (depth == 0)
+    {
+        co_return 0;
+    }
+    co_return 1 + co_await pmr_chain(std::allocator_arg, alloc, depth - 1);
+}
+
+guilt::annotated_task<int> annotated_chain(guilt::context ctx, int depth)
+{
+    co_await guilt::describe_function{ "annotated_chain" };
+    ctx = co_await guilt::describe_region{ "recurse" };
+
+    if (depth == 0)
+    {
+        co_return 0;
+    }
+    co_return 1 + co_await annotated_chain(ctx, depth - 1);
+}
+
+guilt::annotated_task<int> annotated_pmr_chain(
+    std::allocator_arg_t,
+    std::pmr::polymorphic_allocator<> alloc,
+    guilt::context ctx,
+    int depth)
+{
+    co_await guilt::describe_function{ "annotated_pmr_chain" };
+    ctx = co_await guilt::describe_region{ "recurse" };
+
+    if (depth == 0)
+    {
+        co_return 0;
+    }
+    co_return 1 + co_await annotated_pmr_chain(std::allocator_arg, alloc, ctx, depth - 1);
+}
+
+void task_benchmarks()
+{
+    run("task_create_destroy",
+        0,
+        [](std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                auto task = value_task(i);
+                do_not_optimize(task);
+            }
+            return n;
+        });
+
+    run("await_ready_task",
+        0,
+        [](std::size_t n)
+        {
+            auto ready = value_task(1);
+            ready.start();
+            drain();
+
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                auto task = await_value(ready);
+                task.start();
+                drain();
+                do_not_optimize(task.await_resume());
+            }
+            return n;
+        });
+
+    run("await_pending_task",
+        0,
+        [](std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                auto pending = value_task(i);
+                auto task = await_value(pending);
+                task.start();
+                pending.start();
+                drain();
+                do_not_optimize(task.await_resume());
+            }
+            return n;
+        });
+
+    auto when_all_width = [](auto width)
+    {
+        run("when_all",
+            width.value,
+            [](std::size_t n)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    auto task = fan_in(std::make_index_sequence<decltype(width)::value>());
+                    task.start();
+                    drain();
+                    do_not_optimize(task.await_resume());
+                }
+                return n;
+            });
+    };
+    when_all_width(std::integral_constant<std::size_t, 2>());
+    when_all_width(std::integral_constant<std::size_t, 8>());
+    when_all_width(std::integral_constant<std::size_t, 32>());
+
+    for (std::size_t width : { 2, 32, 256 })
+    {
+        run("when_all_range",
+            width,
+            [&](std::size_t n)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    auto task = fan_in_range(width);
+                    task.start();
+                    drain();
+                    do_not_optimize(task.await_resume());
+                }
+                return n;
+            });
+    }
+
+    run("execution_context_callbacks",
+        0,
+        [](std::size_t n)
+        {
+            auto executor = guilt::global_execution_context().get_executor();
+            std::size_t count = 0;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                executor.execute([&] { ++count; });
+            }
+            drain();
+            do_not_optimize(count);
+            return n;
+        });
+
+    run("execution_context_resumptions",
+        0,
+        [](std::size_t n)
+        {
+            std::vector<guilt::task<int>> tasks;
+            tasks.reserve(n);
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                tasks.push_back(value_task(i));
+                tasks.back().start();
+            }
+            drain();
+            return n;
+        });
+
+    // The same, on a priority_execution_context: first with every task at the same priority, then spread
+    // over all of them.
+    for (std::size_t spread : { 1, 4 })
+    {
+        run("priority_context_resumptions",
+            spread,
+            [&](std::size_t n)
+            {
+                guilt::priority_execution_context context;
+                std::vector<guilt::task<int>> tasks;
+                tasks.reserve(n);
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    tasks.push_back(value_task(i));
+                    tasks.back().set_execution_context(context);
+                    tasks.back().start(static_cast<guilt::task_priority>(i % spread));
+                }
+                context.handle_all();
+                return n;
+            });
+    }
+}
+
+void graph_benchmarks()
+{
+    for (std::size_t nodes : { 1000, 10000, 100000 })
+    {
+        for (std::size_t edges_per_node : { 2, 8 })
+        {
+            for (bool batch : { false, true })
+            {
+                const char * names[2][2] = {
+                    { "add_edge_e2", "add_edge_e8" },
+                    { "add_edges_e2", "add_edges_e8" },
+                };
+
+                // Nodes are created roughly, but not exactly, in dependency order, the way tasks usually are:
+                // edges follow a topological order that is shuffled within windows of 64 ids, so some of them
+                // have to reorder it. Every edge points forward in that order, keeping the graph acyclic.
+                // The add_edges variants add all of a graph's edges as a single batch.
+                run(names[batch][edges_per_node == 8],
+                    nodes,
+                    [&](std::size_t n)
+                    {
+                        std::size_t operations = 0;
+                        std::mt19937 random{ 42 };
+                        for (std::size_t round = 0; round < n; ++round)
+                        {
+                            guilt::dependency_graph graph;
+                            auto cluster = graph.add_cluster("cluster");
+                            std::vector<guilt::node_id> ids;
+                            for (std::size_t i = 0; i < nodes; ++i)
+                            {
+                                ids.push_back(graph.add_node(cluster, "node"));
+                            }
+
+                            std::vector<std::size_t> permutation(nodes);
+                            std::iota(permutation.begin(), permutation.end(), 0);
+                            for (std::size_t i = 0; i < nodes; i += 64)
+                            {
+                                std::shuffle(
+                                    permutation.begin() + i,
+                                    permutation.begin() + std::min(i + 64, nodes),
+                                    random);
+                            }
+
+                            std::vector<guilt::batch_edge> edges;
+                            for (std::size_t i = 1; i < nodes; ++i)
+                            {
+                                for (std::size_t e = 0; e < edges_per_node; ++e)
+                                {
+                                    auto back = 1 + random() % std::min<std::size_t>(i, 64);
+                                    auto from = ids[permutation[i - back]];
+                                    auto to = ids[permutation[i]];
+                                    if (batch)
+                                    {
+                                        edges.push_back({ from, to });
+                                    }
+                                    else
+                                    {
+                                        graph.add_edge(from, to);
+                                    }
+                                    ++operations;
+                                }
+                            }
+
+                            if (batch)
+                            {
+                                do_not_optimize(graph.add_edges(edges));
+                            }
+                        }
+                        return operations;
+                    });
+            }
+        }
+    }
+
+    // Edges from a fresh node to the first node of the graph: each of them makes the topological order search
+    // and shift the whole graph.
+    for (std::size_t nodes : { 1000, 100000 })
+    {
+        std::mt19937 random{ 42 };
+        guilt::dependency_graph graph;
+        auto cluster = graph.add_cluster("cluster");
+        std::vector<guilt::node_id> ids;
+        for (std::size_t i = 0; i < nodes; ++i)
+        {
+            ids.push_back(graph.add_node(cluster, "node", "description"));
+            if (i)
+            {
+                graph.add_edge(ids[i - 1], ids[i]);
+                graph.add_edge(ids[random() % i], ids[i], guilt::edge_type::depend, "label");
+            }
+        }
+
+        run("reorder_graph",
+            nodes,
+            [&](std::size_t n)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    graph.add_edge(graph.add_node(cluster, "fresh"), ids.front());
+                }
+                return n;
+            });
+    }
+
+    // A shared task awaited over and over from the same place: param 1 merges the duplicate edges.
+    for (auto duplicates : { guilt::duplicate_edges::keep, guilt::duplicate_edges::merge })
+    {
+        run("add_duplicate_edge",
+            static_cast<std::size_t>(duplicates),
+            [&](std::size_t n)
+            {
+                guilt::dependency_graph graph{ duplicates };
+                auto cluster = graph.add_cluster("cluster");
+                auto shared = graph.add_node(cluster, "shared");
+                auto awaiting = graph.add_node(cluster, "awaiting");
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    graph.add_edge(shared, awaiting, guilt::edge_type::depend, {}, { __FILE__, __LINE__ });
+                }
+                do_not_optimize(graph.edge_count());
+                return n;
+            });
+    }
+
+    for (std::size_t nodes : { 100, 1000, 10000 })
+    {
+        guilt::dependency_graph graph;
+        auto cluster = graph.add_cluster("cluster");
+        std::vector<guilt::node_id> ids;
+        for (std::size_t i = 0; i < nodes; ++i)
+        {
+            ids.push_back(graph.add_node(cluster, "node", "description"));
+            if (i)
+            {
+                graph.add_edge(ids[i - 1], ids[i], guilt::edge_type::depend, "label");
+            }
+        }
+
+        run("to_graphviz",
+            nodes,
+            [&](std::size_t n)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    do_not_optimize(graph.to_graphviz());
+                }
+                return n;
+            });
+    }
+}
+
+void annotation_benchmarks()
+{
+    constexpr int depth = 16;
+
+    run("chain_plain_task",
+        depth,
+        [](std::size_t n)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                auto task = plain_chain(depth);
+                task.start();
+                drain();
+                do_not_optimize(task.await_resume());
+            }
+            return n;
+        });
+
+    // The same, with the frames allocated from a memory resource that is reset after every chain.
+    run("chain_plain_task_pmr",
+        depth,
+        [](std::size_t n)
+        {
+            std::pmr::monotonic_buffer_resource resource;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                {
+                    auto task = pmr_chain(std::allocator_arg, &resource, depth);
+                    task.start();
+                    drain();
+                    do_not_optimize(task.await_resume());
+                }
+                resource.release();
+            }
+            return n;
+        });
+
+    // The same, with a cancellation token that every link of the chain inherits and checks.
+    run("chain_plain_task_cancellable",
+        depth,
+        [](std::size_t n)
+        {
+            guilt::cancellation_source source;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                auto task = plain_chain(depth);
+                task.set_cancellation_token(source.get_token());
+                task.start();
+                drain();
+                do_not_optimize(task.await_resume());
+            }
+            return n;
+        });
+
+    run("chain_annotated_task",
+        depth,
+        [](std::size_t n)
+        {
+            guilt::dependency_graph graph;
+            auto main_cluster = graph.add_cluster("main()");
+            auto main_node = graph.add_node(main_cluster, "main()");
+
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                auto task = annotated_chain({ &graph, main_cluster, main_node }, depth);
+                task.start();
+                drain();
+                do_not_optimize(task.await_resume());
+            }
+            return n;
+        });
+
+    run("chain_annotated_task_pmr",
+        depth,
+        [](std::size_t n)
+        {
+            guilt::dependency_graph graph;
+            auto main_cluster = graph.add_cluster("main()");
+            auto main_node = graph.add_node(main_cluster, "main()");
+
+            std::pmr::monotonic_buffer_resource resource;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                {
+                    guilt::context ctx{ &graph, main_cluster, main_node };
+                    auto task = annotated_pmr_chain(std::allocator_arg, &resource, ctx, depth);
+                    task.start();
+                    drain();
+                    do_not_optimize(task.await_resume());
+                }
+                resource.release();
+            }
+            return n;
+        });
+
+#ifndef GUILT_DISABLE_ANNOTATIONS
+    // The same, with the graph reclaiming the nodes of completed chains, which keeps it a few chains in size.
+    run("chain_annotated_task_retained",
+        depth,
+        [](std::size_t n)
+        {
+            guilt::dependency_graph graph{ guilt::retention_policy{} };
+            auto main_cluster = graph.add_cluster("main()");
+            auto main_node = graph.add_node(main_cluster, "main()");
+
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                auto task = annotated_chain({ &graph, main_cluster, main_node }, depth);
+                task.start();
+                drain();
+                do_not_optimize(task.await_resume());
+            }
+            do_not_optimize(graph.node_count());
+            return n;
+        });
+#endif
+}
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1)
+    {
+        benchmark_filter = argv[1];
+    }
+
+    task_benchmarks();
+    graph_benchmarks();
+    annotation_benchmarks();
+}
@@ -0,0 +1,104 @@
+#include "guilt/annotated.h"
+
+// Goes back through the queue, so that main() gets to run in between the steps.
+struct yield
+{
+    bool await_ready() const
+    {
+        return false;
+    }
+
+    void await_suspend(guilt::coro::coroutine_handle<> h) const
+    {
+        guilt::global_execution_context().get_executor().schedule(h);
+    }
+
+    void await_resume() const
+    {
+    }
+};
+
+guilt::task<int> count_slowly(int n)
+{
+    auto token = co_await guilt::get_cancellation_token;
+
+    int steps = 0;
+    for (; steps < n; ++steps)
+    {
+        co_await yield{};
+        co_await token;
+    }
+
+    co_return steps;
+}
+
+guilt::task<int> sum_counts(int n)
+{
+    // The children inherit this task's token when they are awaited.
+    auto counts = co_await guilt::when_all(count_slowly(n), count_slowly(n));
+    co_return std::get<0>(counts) + std::get<1>(counts);
+}
+
+guilt::annotated_task<int> leaf(guilt::context ctx, int n)
+{
+    co_await guilt::describe_function{ "leaf" };
+    ctx = co_await guilt::describe_region{ "count" };
+
+    // Annotated tasks start running as soon as they are called, before when_any gets to hand them a token, so
+    // the token is looked up again at every step.
+    int steps = 0;
+    for (; steps < n; ++steps)
+    {
+        co_await yield{};
+        (co_await guilt::get_cancellation_token).throw_if_cancelled();
+    }
+
+    co_return steps;
+}
+
+guilt::annotated_task<int> create_work(guilt::context ctx)
+{
+    co_await guilt::describe_function{ "create work" };
+
+    ctx = co_await guilt::describe_region{ "race the leaves" };
+    auto first = co_await guilt::when_any(ctx, leaf(ctx, 2), leaf(ctx, 1000));
+    co_return std::get<0>(first.value);
+}
+
+int main()
+{
+    auto & context = guilt::global_execution_context();
+
+    guilt::cancellation_source source;
+    auto task = sum_counts(1000);
+    task.set_cancellation_token(source.get_token());
+    task.start();
+
+    for (int i = 0; i < 10; ++i)
+    {
+        context.handle_single();
+    }
+    source.cancel();
+    context.handle_all();
+
+    try
+    {
+        task.await_resume();
+    }
+    catch (const guilt::operation_cancelled & ex)
+    {
+        std::cout << "sum_counts: " << ex.what() << std::endl;
+    }
+
+    // The loser of the race is cancelled once the winner completes, and the graph shows where it stopped.
+    guilt::dependency_graph graph;
+    auto main_cluster = graph.add_cluster("main()");
+    auto main_node = graph.add_node(main_cluster, "main()");
+
+    auto raced = create_work({ &graph, main_cluster, main_node });
+    raced.start();
+    context.handle_all();
+
+    std::cout << "create work: " << raced.await_resume() << std::endl;
+    std::cout << graph.to_graphviz() << std::endl;
+}
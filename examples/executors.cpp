@@ -0,0 +1,43 @@
+#include "guilt/thread_pool.h"
+
+guilt::task<int> crunch(int i)
+{
+    co_return i * i;
+}
+
+guilt::task<int> create_work(guilt::execution_context & main_context, guilt::execution_context & workers)
+{
+    std::vector<guilt::task<int>> tasks;
+    for (int i = 0; i < 16; ++i)
+    {
+        tasks.push_back(crunch(i));
+        tasks.back().set_execution_context(workers);
+    }
+
+    // The squares are computed on the workers, while the sum is taken back on the main context.
+    auto squares = co_await guilt::resume_on(main_context, guilt::when_all(std::move(tasks)));
+    assert(guilt::execution_context::current() == &main_context);
+
+    int sum = 0;
+    for (auto square : squares)
+    {
+        sum += square;
+    }
+
+    co_await guilt::schedule_on(workers);
+    assert(guilt::execution_context::current() == &workers);
+
+    co_return sum;
+}
+
+int main()
+{
+    guilt::thread_pool_execution_context workers{ 4 };
+    auto & main_context = guilt::global_execution_context();
+
+    auto task = create_work(main_context, workers);
+    task.start();
+    main_context.run_until([&] { return task.is_ready(); });
+
+    std::cout << task.await_resume() << std::endl;
+}
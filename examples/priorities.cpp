@@ -0,0 +1,55 @@
+#include "guilt/annotated.h"
+#include "guilt/priority_context.h"
+
+// Goes back through the queue, at the priority of the job running it.
+struct yield
+{
+    bool await_ready() const
+    {
+        return false;
+    }
+
+    void await_suspend(guilt::coro::coroutine_handle<> h) const
+    {
+        guilt::execution_context::current()->get_executor().schedule(h);
+    }
+
+    void await_resume() const
+    {
+    }
+};
+
+guilt::annotated_task<void> urgent(guilt::context ctx)
+{
+    co_await guilt::describe_function{ "urgent", guilt::task_priority::critical };
+    ctx = co_await guilt::describe_region{ "steps" };
+
+    for (int i = 0; i < 2; ++i)
+    {
+        std::cout << "urgent" << i << ' ';
+        co_await yield{};
+    }
+}
+
+// The task's own priority keeps it ahead of the jobs queued after it, whether or not annotations are compiled
+// out; both ways, this prints "urgent0 urgent1 bulk0 bulk1 bulk2".
+int main()
+{
+    guilt::priority_execution_context context;
+
+    guilt::dependency_graph graph;
+    auto main_cluster = graph.add_cluster("main()");
+    auto main_node = graph.add_node(main_cluster, "main()");
+
+    auto task = urgent({ &graph, main_cluster, main_node });
+    task.start(context);
+
+    for (int i = 0; i < 3; ++i)
+    {
+        context.get_executor().execute(
+            [i] { std::cout << "bulk" << i << ' '; }, guilt::task_priority::normal);
+    }
+
+    context.handle_all();
+    std::cout << std::endl;
+}
@@ -0,0 +1,52 @@
+#include "guilt/annotated.h"
+#include "guilt/critical_path.h"
+
+#include <fstream>
+
+guilt::annotated_task<int> leaf(guilt::context ctx, int i)
+{
+    co_await guilt::describe_function{ "leaf" };
+    ctx = co_await guilt::describe_region{ "compute" };
+    co_return i * i;
+}
+
+guilt::annotated_task<int> create_work(guilt::context ctx)
+{
+    co_await guilt::describe_function{ "create work" };
+
+    ctx = co_await guilt::describe_region{ "start the work" };
+    auto left = leaf(ctx, 3);
+    auto right = leaf(ctx, 4);
+
+    ctx = co_await guilt::describe_region{ "await the results" };
+    auto l = co_await left;
+    auto r = co_await right;
+    co_return l + r;
+}
+
+int main()
+{
+    guilt::dependency_graph graph;
+    auto main_cluster = graph.add_cluster("main()");
+    auto main_node = graph.add_node(main_cluster, "main()");
+
+    guilt::profiler profiler;
+    guilt::set_active_profiler(&profiler);
+
+    auto task = create_work({ &graph, main_cluster, main_node });
+    task.start();
+    guilt::global_execution_context().handle_all_until([&] { return task.is_ready(); });
+    assert(task.is_ready());
+
+    guilt::set_active_profiler(nullptr);
+
+    std::ofstream trace{ "trace.json" };
+    profiler.write_chrome_trace(trace, graph);
+
+    auto analysis = guilt::analyze_critical_path(graph, guilt::durations_from_profile(profiler));
+    std::ofstream critical_path{ "critical_path.dot" };
+    graph.write_graphviz(critical_path, analysis.highlight());
+    std::ofstream critical_path_json{ "critical_path.json" };
+    analysis.write_json(critical_path_json, graph);
+    std::cout << task.await_resume() << std::endl;
+}
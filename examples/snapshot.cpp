@@ -0,0 +1,50 @@
+#include "guilt/annotated.h"
+#include "guilt/snapshot.h"
+
+#include <fstream>
+#include <sstream>
+
+guilt::annotated_task<int> leaf(guilt::context ctx, int i)
+{
+    co_await guilt::describe_function{ "leaf" };
+    ctx = co_await guilt::describe_region{ "compute" };
+    co_return i * i;
+}
+
+guilt::annotated_task<int> create_work(guilt::context ctx)
+{
+    co_await guilt::describe_function{ "create work" };
+
+    ctx = co_await guilt::describe_region{ "await the leaves" };
+    auto [l, r] = co_await guilt::when_all(ctx, leaf(ctx, 3), leaf(ctx, 4));
+    co_return l + r;
+}
+
+int main()
+{
+    guilt::dependency_graph graph;
+    auto main_cluster = graph.add_cluster("main()");
+    auto main_node = graph.add_node(main_cluster, "main()");
+
+    auto task = create_work({ &graph, main_cluster, main_node });
+    task.start();
+    guilt::global_execution_context().handle_all_until([&] { return task.is_ready(); });
+
+    {
+        std::ofstream file{ "graph.snapshot", std::ios::binary };
+        guilt::graph_snapshot::write(file, graph);
+    }
+
+    // Offline tools would rather map the file into memory; any buffer aligned to 8 bytes will do.
+    std::ifstream file{ "graph.snapshot", std::ios::binary | std::ios::ate };
+    std::vector<std::uint64_t> buffer((static_cast<std::size_t>(file.tellg()) + 7) / 8);
+    file.seekg(0);
+    file.read(reinterpret_cast<char *>(buffer.data()), buffer.size() * 8);
+
+    guilt::graph_snapshot snapshot{ std::as_bytes(std::span{ buffer }) };
+    std::cout << snapshot.nodes().size() << " nodes, " << snapshot.edges().size() << " edges" << std::endl;
+
+    guilt::dependency_graph loaded;
+    snapshot.load(loaded);
+    std::cout << (loaded.to_graphviz() == graph.to_graphviz() ? "identical" : "different") << std::endl;
+}
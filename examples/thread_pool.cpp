@@ -0,0 +1,46 @@
+#include "guilt/thread_pool.h"
+
+auto & base_task()
+{
+    static auto ret = []() -> guilt::task<int>
+    {
+        std::cout << "base" << std::endl;
+        co_return 1;
+    }();
+    return ret;
+}
+
+guilt::task<int> leaf(int i)
+{
+    co_return i + co_await base_task();
+}
+
+guilt::task<int> create_work()
+{
+    std::vector<guilt::task<int>> tasks;
+    for (int i = 0; i < 64; ++i)
+    {
+        tasks.push_back(leaf(i));
+        tasks.back().start();
+    }
+
+    int sum = 0;
+    for (auto && task : tasks)
+    {
+        sum += co_await task;
+    }
+    co_return sum;
+}
+
+int main()
+{
+    guilt::thread_pool_execution_context pool;
+    guilt::set_global_execution_context(pool);
+
+    auto task = create_work();
+    task.start();
+    pool.handle_all_until([&] { return task.is_ready(); });
+    assert(task.is_ready());
+
+    std::cout << task.await_resume() << std::endl;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "graph.h"
+#include "profiling.h"
 #include "tasking.h"
 
 #if __GNUC__ >= 11
@@ -16,6 +17,7 @@ struct region_state
     node_id end_node;
 };
 
+#ifndef GUILT_DISABLE_ANNOTATIONS
 struct context
 {
     dependency_graph * graph;
@@ -53,16 +55,106 @@ namespace detail
         {
         }
 
+        // Once the frame is gone, nobody can await the task anymore, so nothing adds edges into its nodes.
+        // Frames of graphs without a retention policy do not touch the graph, which may be gone by then.
+        ~annotation_shared_state()
+        {
+            if (!retiring)
+            {
+                return;
+            }
+
+            auto & graph = *captured_context.graph;
+            if (function && !use_captured)
+            {
+                graph.retire(*function);
+            }
+            graph.retire(nodes);
+        }
+
         context captured_context;
 
         std::optional<cluster_id> function = std::nullopt;
         std::optional<region_state> region = std::nullopt;
+        // The nodes of all the regions so far; only kept for graphs with a retention policy.
+        std::vector<node_id> nodes;
 
         bool use_predecessor = true;
         bool use_captured = false;
+        bool retiring = false;
+
+        // Events are keyed by the current region's begin node.
+        void record(trace_event_kind kind) const
+        {
+            if (function && region)
+            {
+                record_trace_event(kind, *function, region->start_node);
+            }
+        }
+    };
+
+    // Forwards to another awaiter, recording when the awaiting coroutine suspends and resumes.
+    template<typename Awaiter>
+    class profiled_awaiter
+    {
+    public:
+        profiled_awaiter(Awaiter awaiter, const annotation_shared_state & state)
+            : _awaiter{ std::forward<Awaiter>(awaiter) }, _state{ state }
+        {
+        }
+
+        bool await_ready()
+        {
+            return _awaiter.await_ready();
+        }
+
+        auto await_suspend(coro::coroutine_handle<> h)
+        {
+            _suspended = true;
+            _state.record(trace_event_kind::suspend);
+            return _awaiter.await_suspend(h);
+        }
+
+        decltype(auto) await_resume()
+        {
+            if (_suspended)
+            {
+                _state.record(trace_event_kind::resume);
+            }
+            return _awaiter.await_resume();
+        }
+
+    private:
+        Awaiter _awaiter;
+        const annotation_shared_state & _state;
+        bool _suspended = false;
     };
+
+    template<typename Awaitable>
+    auto make_profiled_awaiter(Awaitable && awaitable, const annotation_shared_state & state)
+    {
+        if constexpr (requires { std::forward<Awaitable>(awaitable).operator co_await(); })
+        {
+            auto && awaiter = std::forward<Awaitable>(awaitable).operator co_await();
+            return profiled_awaiter<std::remove_cvref_t<decltype(awaiter)>>{ std::move(awaiter), state };
+        }
+        else
+        {
+            return profiled_awaiter<Awaitable>{ std::forward<Awaitable>(awaitable), state };
+        }
+    }
 }
 
+#ifdef HAS_SOURCE_LOCATION
+namespace detail
+{
+    inline source_location to_source_location(const std::source_location & loc)
+    {
+        return { loc.file_name(), loc.line() };
+    }
+}
+#endif
+
 template<typename T>
 class annotated_task;
 
@@ -96,17 +188,27 @@ functional_awaiter(F) -> functional_awaiter<F>;
 
 struct describe_function
 {
-    std::string name;
-    std::string description;
+    std::string_view name;
+    std::string_view description;
+    source_location loc = {};
+    // Gives the task a priority of its own, instead of the one of whoever starts it.
+    std::optional<task_priority> priority = std::nullopt;
 
 #ifdef HAS_SOURCE_LOCATION
     describe_function(
-        std::string name,
-        std::string description = "",
+        std::string_view name,
+        std::string_view description = {},
+        std::source_location loc = std::source_location::current())
+        : name(name), description(description), loc(detail::to_source_location(loc))
+    {
+    }
+
+    describe_function(
+        std::string_view name,
+        task_priority priority,
+        std::string_view description = {},
         std::source_location loc = std::source_location::current())
-        : name(std::move(name)),
-          description(
-              std::string("at ") + loc.file_name() + ":" + std::to_string(loc.line()) + "\n" + description)
+        : name(name), description(description), loc(detail::to_source_location(loc)), priority(priority)
     {
     }
 #endif
@@ -114,17 +216,16 @@ struct describe_function
 
 struct describe_region
 {
-    std::string name;
-    std::string description;
+    std::string_view name;
+    std::string_view description;
+    source_location loc = {};
 
 #ifdef HAS_SOURCE_LOCATION
     describe_region(
-        std::string name,
-        std::string description = "",
+        std::string_view name,
+        std::string_view description = {},
         std::source_location loc = std::source_location::current())
-        : name(std::move(name)),
-          description(
-              std::string("at ") + loc.file_name() + ":" + std::to_string(loc.line()) + "\n" + description)
+        : name(name), description(description), loc(detail::to_source_location(loc))
     {
     }
 #endif
@@ -143,7 +244,7 @@ constexpr inline struct inherit_function_t
 } inherit_function;
 
 template<typename T>
-class annotated_promise_base
+class annotated_promise_base : public detail::frame_allocation
 {
 protected:
     template<typename>
@@ -156,14 +257,28 @@ public:
     using value_type = T;
 
     template<typename... Other>
-    annotated_promise_base(context ctx, Other &&... other)
+    annotated_promise_base(context ctx, Other &&...)
         : _state{ std::move(ctx) },
           _wrapped{ coro::coroutine_handle<annotated_promise_base<T>>::from_promise(*this) }
     {
     }
 
     template<typename Class, typename... Other>
-    annotated_promise_base(Class &&, context ctx, Other &&... other)
+    annotated_promise_base(Class &&, context ctx, Other &&...)
+        : _state{ std::move(ctx) },
+          _wrapped{ coro::coroutine_handle<annotated_promise_base<T>>::from_promise(*this) }
+    {
+    }
+
+    template<typename Alloc, typename... Other>
+    annotated_promise_base(std::allocator_arg_t, const Alloc &, context ctx, Other &&...)
+        : _state{ std::move(ctx) },
+          _wrapped{ coro::coroutine_handle<annotated_promise_base<T>>::from_promise(*this) }
+    {
+    }
+
+    template<typename Class, typename Alloc, typename... Other>
+    annotated_promise_base(Class &&, std::allocator_arg_t, const Alloc &, context ctx, Other &&...)
         : _state{ std::move(ctx) },
           _wrapped{ coro::coroutine_handle<annotated_promise_base<T>>::from_promise(*this) }
     {
@@ -182,6 +297,11 @@ public:
     }
     auto final_suspend() noexcept
     {
+        if (_cancelled)
+        {
+            _record_cancellation();
+        }
+        _state.record(trace_event_kind::region_end);
         return _wrapped.final_suspend();
     }
 
@@ -193,39 +313,68 @@ public:
     void unhandled_exception()
     {
         _wrapped.unhandled_exception();
+
+        try
+        {
+            throw;
+        }
+        catch (const operation_cancelled &)
+        {
+            _cancelled = true;
+        }
+        catch (...)
+        {
+        }
     }
 
     template<typename U>
     auto await_transform(U && u)
     {
         assert(_already_suspended);
-        return std::forward<U>(u);
+        return detail::make_profiled_awaiter(
+            detail::make_cancellable(std::forward<U>(u), _wrapped.get_cancellation_token()), _state);
     }
 
-    auto await_transform(describe_function desc)
+    auto await_transform(get_cancellation_token_t tag)
     {
-        auto & [name, description] = desc;
+        return _wrapped.await_transform(tag);
+    }
 
+    // The description's strings are copied into the graph before this returns, so they only need to live as
+    // long as the co_await expression.
+    auto await_transform(describe_function desc)
+    {
         assert(!_state.function);
-        _state.function = _state.captured_context.graph->add_cluster(std::move(name), std::move(description));
+        auto & graph = *_state.captured_context.graph;
+        _state.function = graph.add_cluster(desc.name, desc.description, desc.loc);
+        _state.retiring = graph.retention().has_value();
+
+        if (desc.priority)
+        {
+            _wrapped.set_priority(*desc.priority);
+        }
 
         return coro::suspend_never();
     }
 
     auto await_transform(describe_region desc)
     {
-        auto & [name, description] = desc;
-
         assert(_state.function);
+        _state.record(trace_event_kind::region_end);
         auto old = std::move(_state.region);
 
         auto & graph = *_state.captured_context.graph;
 
         region_state current;
-        current.start_node =
-            graph.add_node(_state.function.value(), "begin: " + name, std::move(description));
-        current.end_node = graph.add_node(_state.function.value(), "end: " + name, std::move(description));
+        current.start_node = graph.add_node(
+            _state.function.value(), desc.name, desc.description, desc.loc, node_kind::region_begin);
+        current.end_node = graph.add_node(_state.function.value(), desc.name, {}, {}, node_kind::region_end);
         graph.add_edge(current.start_node, current.end_node, edge_type::flow);
+        if (graph.retention())
+        {
+            _state.retiring = true;
+            _state.nodes.insert(_state.nodes.end(), { current.start_node, current.end_node });
+        }
 
         if (old)
         {
@@ -253,6 +402,7 @@ public:
 
             auto await_resume()
             {
+                self->_state.record(trace_event_kind::region_begin);
                 return self->get_context();
             }
 
@@ -337,9 +487,38 @@ public:
     }
 
 private:
+    // A region that ends in cancellation goes through a cancelled node on its way to its end node. Recording
+    // it is best effort: the task completes all the same if the graph refuses the node or one of its edges.
+    void _record_cancellation() noexcept
+    {
+        if (!_state.region)
+        {
+            return;
+        }
+
+        try
+        {
+            auto & graph = *_state.captured_context.graph;
+            auto node = graph.add_node(
+                *_state.function, graph.cluster_name(*_state.function), {}, {}, node_kind::cancelled);
+            if (graph.retention())
+            {
+                _state.retiring = true;
+                _state.nodes.push_back(node);
+            }
+            graph.add_edge(_state.region->start_node, node, edge_type::flow);
+            graph.add_edge(node, _state.region->end_node, edge_type::flow);
+        }
+        catch (...)
+        {
+        }
+    }
+
     detail::annotation_shared_state _state;
     promise<T> _wrapped;
     bool _already_suspended = std::is_same<decltype(_wrapped.initial_suspend()), coro::suspend_never>::value;
+    // Set by unhandled_exception; the cancellation is recorded once the coroutine reaches its final suspend.
+    bool _cancelled = false;
 };
 
 template<typename T>
@@ -391,9 +570,9 @@ public:
         return _wrapped.await_ready();
     }
 
-    auto await_suspend(coro::coroutine_handle<> h)
+    auto operator co_await() const
     {
-        return _wrapped.await_suspend(std::move(h));
+        return _wrapped.operator co_await();
     }
 
     auto await_resume()
@@ -403,7 +582,40 @@ public:
 
     void start()
     {
-        coro::coroutine_handle<annotated_promise_base<T>>::from_promise(*_promise).resume();
+        _wrapped.start();
+    }
+
+    void start(execution_context & ctx)
+    {
+        _wrapped.start(ctx);
+    }
+
+    void set_execution_context(execution_context & ctx)
+    {
+        _wrapped.set_execution_context(ctx);
+    }
+
+    void start(task_priority priority)
+    {
+        _wrapped.start(priority);
+    }
+
+    void set_priority(task_priority priority)
+    {
+        _wrapped.set_priority(priority);
+    }
+
+    // Annotated tasks start running as soon as they are called, and may already be running on another thread,
+    // so unlike plain tasks, they cannot have a token set; one is only installed if the task has none yet.
+    void inherit_cancellation(const cancellation_token & token) const
+    {
+        _wrapped.inherit_cancellation(token);
+    }
+
+    // The plain task that carries the result, which completes when this one does.
+    task<T> & get_task()
+    {
+        return _wrapped;
     }
 
     auto get_node()
@@ -433,37 +645,17 @@ auto annotated_promise_base<T>::await_transform(
 #endif
 )
 {
-    std::string label;
+    source_location edge_loc;
 #ifdef HAS_SOURCE_LOCATION
-    label = std::string("at ") + loc.file_name() + ":" + std::to_string(loc.line());
+    edge_loc = detail::to_source_location(loc);
 #endif
 
     assert(_state.region);
     _state.captured_context.graph->add_edge(
-        task.get_node(), _state.region->end_node, edge_type::depend, std::move(label));
-
-    // Sigh. Should just do an auto& return type and replicate the rvalue version, but...
-    // ...GCC moves out of the returned lvalue reference in generated code. Sigh.
-
-    struct awaiter_t
-    {
-        annotated_task<U> & task;
-
-        bool await_ready()
-        {
-            return task.await_ready();
-        }
-        auto await_suspend(coro::coroutine_handle<> h)
-        {
-            return task.await_suspend(std::move(h));
-        }
-        auto await_resume()
-        {
-            return task.await_resume();
-        }
-    };
+        task.get_node(), _state.region->end_node, edge_type::depend, {}, edge_loc);
 
-    return awaiter_t{ task };
+    return detail::make_profiled_awaiter(
+        detail::make_cancellable(task, _wrapped.get_cancellation_token()), _state);
 }
 
 template<typename T>
@@ -476,18 +668,59 @@ auto annotated_promise_base<T>::await_transform(
 #endif
 )
 {
-    std::string label;
+    source_location edge_loc;
 #ifdef HAS_SOURCE_LOCATION
-    label = std::string("at ") + loc.file_name() + ":" + std::to_string(loc.line());
+    edge_loc = detail::to_source_location(loc);
 #endif
 
     assert(_state.region);
     _state.captured_context.graph->add_edge(
-        task.get_node(), _state.region->end_node, edge_type::depend, label);
+        task.get_node(), _state.region->end_node, edge_type::depend, {}, edge_loc);
 
-    return std::move(task);
+    return detail::make_profiled_awaiter(
+        detail::make_cancellable(std::move(task), _wrapped.get_cancellation_token()), _state);
 }
 
+namespace detail
+{
+    template<typename T>
+    task<T> & wrapped_task(task<T> & t)
+    {
+        return t;
+    }
+
+    template<typename T>
+    task<T> & wrapped_task(annotated_task<T> & t)
+    {
+        return t.get_task();
+    }
+
+    // Plain tasks have no node to draw the edge from.
+    template<typename T, typename Input>
+    void add_input_edge(
+        annotated_promise_base<T> & promise,
+        Input & input,
+        edge_type type,
+        source_location loc)
+    {
+        if constexpr (requires { input.get_node(); })
+        {
+            promise.get_graph().add_edge(input.get_node(), promise.get_region().end_node, type, {}, loc);
+        }
+    }
+
+    inline source_location call_site(const context & ctx)
+    {
+#ifdef HAS_SOURCE_LOCATION
+        return to_source_location(ctx.loc);
+#else
+        return {};
+#endif
+    }
+}
+
+// Awaits its inputs the same way the plain when_all does, with each annotated input recorded as a dependency
+// of the when_all region.
 template<typename... Ts>
 annotated_task<std::tuple<::guilt::detail::replace_void_t<typename Ts::value_type>...>> when_all(
     context ctx,
@@ -501,6 +734,218 @@ annotated_task<std::tuple<::guilt::detail::replace_void_t<typename Ts::value_typ
                                     ctx.loc
 #endif
     };
-    co_return { (co_await ts)... };
+
+    auto & promise = co_await get_promise;
+    (detail::add_input_edge(promise, ts, edge_type::depend, detail::call_site(ctx)), ...);
+    co_return co_await detail::when_all_awaiter<typename Ts::value_type...>{ detail::wrapped_task(ts)... };
+}
+
+template<typename Task>
+annotated_task<std::vector<::guilt::detail::replace_void_t<typename Task::value_type>>> when_all(
+    context ctx,
+    std::vector<Task> ts)
+{
+    co_await inherit_function;
+    (void)co_await describe_region{ "when_all",
+                                    ""
+#ifdef HAS_SOURCE_LOCATION
+                                    ,
+                                    ctx.loc
+#endif
+    };
+
+    auto & promise = co_await get_promise;
+    std::vector<task<typename Task::value_type>> inputs;
+    inputs.reserve(ts.size());
+    for (auto && t : ts)
+    {
+        detail::add_input_edge(promise, t, edge_type::depend, detail::call_site(ctx));
+        inputs.push_back(detail::wrapped_task(t));
+    }
+    co_return co_await detail::when_all_range_awaiter<typename Task::value_type>{ inputs };
+}
+
+// Races its inputs the same way the plain when_any does. Every annotated input is recorded with a race edge
+// into the when_any region, since only one of them ends up being waited for.
+template<typename... Ts>
+annotated_task<when_any_result<std::variant<::guilt::detail::replace_void_t<typename Ts::value_type>...>>>
+when_any(context ctx, Ts... ts)
+{
+    static_assert(sizeof...(Ts) > 0, "when_any needs at least one task to wait for");
+
+    co_await inherit_function;
+    (void)co_await describe_region{ "when_any",
+                                    ""
+#ifdef HAS_SOURCE_LOCATION
+                                    ,
+                                    ctx.loc
+#endif
+    };
+
+    auto & promise = co_await get_promise;
+    (detail::add_input_edge(promise, ts, edge_type::race, detail::call_site(ctx)), ...);
+    co_return co_await detail::when_any_awaiter<typename Ts::value_type...>{ detail::wrapped_task(ts)... };
+}
+
+template<typename Task>
+annotated_task<when_any_result<::guilt::detail::replace_void_t<typename Task::value_type>>> when_any(
+    context ctx,
+    std::vector<Task> ts)
+{
+    co_await inherit_function;
+    (void)co_await describe_region{ "when_any",
+                                    ""
+#ifdef HAS_SOURCE_LOCATION
+                                    ,
+                                    ctx.loc
+#endif
+    };
+
+    if (ts.empty())
+    {
+        throw std::invalid_argument{ "when_any needs at least one task to wait for" };
+    }
+
+    auto & promise = co_await get_promise;
+    std::vector<task<typename Task::value_type>> inputs;
+    inputs.reserve(ts.size());
+    for (auto && t : ts)
+    {
+        detail::add_input_edge(promise, t, edge_type::race, detail::call_site(ctx));
+        inputs.push_back(detail::wrapped_task(t));
+    }
+    co_return co_await detail::when_any_range_awaiter<typename Task::value_type>{ inputs };
 }
+
+#else
+// With annotations compiled out, annotated coroutines are plain tasks, and everything that only feeds the
+// graph is empty: contexts carry nothing, and awaiting a description does nothing. get_promise, and the
+// members that annotated_task has on top of task, are not available in this mode.
+template<typename T = void>
+using annotated_task = task<T>;
+
+struct context
+{
+    context() = default;
+
+    context(dependency_graph *, cluster_id, node_id)
+    {
+    }
+};
+
+namespace detail
+{
+    template<typename T>
+    struct ready_awaitable
+    {
+        bool await_ready() const noexcept
+        {
+            return true;
+        }
+
+        void await_suspend(coro::coroutine_handle<>) const noexcept
+        {
+        }
+
+        T await_resume() const noexcept
+        {
+            return T();
+        }
+    };
+}
+
+// Only a priority has any effect. The constructors take the same arguments as with annotations enabled, and
+// ignore all but the priority.
+struct describe_function
+{
+#ifdef HAS_SOURCE_LOCATION
+    describe_function(
+        std::string_view,
+        std::string_view = {},
+        std::source_location = std::source_location::current())
+    {
+    }
+
+    describe_function(
+        std::string_view,
+        task_priority priority,
+        std::string_view = {},
+        std::source_location = std::source_location::current())
+        : priority(priority)
+    {
+    }
+#else
+    describe_function(std::string_view, std::string_view = {})
+    {
+    }
+
+    describe_function(std::string_view, task_priority priority, std::string_view = {}) : priority(priority)
+    {
+    }
+#endif
+
+    bool await_ready() const noexcept
+    {
+        return !priority;
+    }
+
+    // A plain task only gets here once it is running, at the priority it was started with. One started at
+    // another priority yields once, to be resumed at the one it describes, and from then on runs as it would
+    // with annotations enabled; only the jobs queued before it was started get their turn first.
+    template<typename Promise>
+    bool await_suspend(coro::coroutine_handle<Promise> h) const
+    {
+        h.promise().set_priority(*priority);
+        if (*priority == execution_context::current_priority())
+        {
+            return false;
+        }
+
+        detail::enqueue(execution_context::current(), h, *priority);
+        return true;
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+
+    std::optional<task_priority> priority;
+};
+
+struct describe_region : detail::ready_awaitable<context>
+{
+#ifdef HAS_SOURCE_LOCATION
+    describe_region(
+        std::string_view,
+        std::string_view = {},
+        std::source_location = std::source_location::current())
+    {
+    }
+#else
+    describe_region(std::string_view, std::string_view = {})
+    {
+    }
+#endif
+};
+
+constexpr inline struct get_context_t : detail::ready_awaitable<context>
+{
+} get_context;
+
+constexpr inline struct inherit_function_t : detail::ready_awaitable<void>
+{
+} inherit_function;
+
+template<typename... Ts>
+auto when_all(context, Ts... ts)
+{
+    return when_all(std::move(ts)...);
+}
+
+template<typename... Ts>
+auto when_any(context, Ts... ts)
+{
+    return when_any(std::move(ts)...);
+}
+#endif
 }
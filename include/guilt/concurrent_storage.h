@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <limits>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+namespace guilt
+{
+namespace detail
+{
+    // A test-and-test-and-set lock, small enough to put into every element of a large container.
+    class spin_lock
+    {
+    public:
+        void lock()
+        {
+            while (_flag.test_and_set(std::memory_order_acquire))
+            {
+                while (_flag.test(std::memory_order_relaxed))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        bool try_lock()
+        {
+            return !_flag.test_and_set(std::memory_order_acquire);
+        }
+
+        void unlock()
+        {
+            _flag.clear(std::memory_order_release);
+        }
+
+    private:
+        std::atomic_flag _flag;
+    };
+
+    // An array that grows in segments of doubling size, so that elements never move and any thread can make
+    // room for a new element while others access existing ones. Elements are default constructed a segment at
+    // a time; handing out indices is up to the user.
+    template<typename T, std::size_t FirstSegment = 64>
+    class segmented_vector
+    {
+        static_assert(std::has_single_bit(FirstSegment));
+
+    public:
+        segmented_vector() = default;
+
+        segmented_vector(const segmented_vector &) = delete;
+        segmented_vector & operator=(const segmented_vector &) = delete;
+
+        ~segmented_vector()
+        {
+            for (auto && segment : _segments)
+            {
+                delete[] segment.load(std::memory_order_relaxed);
+            }
+        }
+
+        // The element has to be in a segment that already exists, i.e. its index must have been passed to
+        // ensure() by a call that happens before this one.
+        T & operator[](std::size_t index)
+        {
+            auto [segment, offset] = _locate(index);
+            return _segments[segment].load(std::memory_order_acquire)[offset];
+        }
+
+        const T & operator[](std::size_t index) const
+        {
+            auto [segment, offset] = _locate(index);
+            return _segments[segment].load(std::memory_order_acquire)[offset];
+        }
+
+        // Allocates the segment holding index if nobody did so yet. Safe to call concurrently.
+        T & ensure(std::size_t index)
+        {
+            auto [segment, offset] = _locate(index);
+            auto data = _segments[segment].load(std::memory_order_acquire);
+            if (!data)
+            {
+                auto allocated = new T[FirstSegment << segment];
+                if (_segments[segment].compare_exchange_strong(data, allocated, std::memory_order_acq_rel))
+                {
+                    data = allocated;
+                }
+                else
+                {
+                    delete[] allocated;
+                }
+            }
+
+            return data[offset];
+        }
+
+    private:
+        static constexpr std::size_t _first_segment_bits = std::bit_width(FirstSegment) - 1;
+        static constexpr std::size_t _max_segments =
+            std::numeric_limits<std::size_t>::digits - _first_segment_bits;
+
+        struct location
+        {
+            std::size_t segment;
+            std::size_t offset;
+        };
+
+        static location _locate(std::size_t index)
+        {
+            auto biased = index + FirstSegment;
+            auto segment = std::bit_width(biased) - 1 - _first_segment_bits;
+            return { segment, biased - (FirstSegment << segment) };
+        }
+
+        std::atomic<T *> _segments[_max_segments] = {};
+    };
+
+    // Stores every distinct string once and identifies it by a dense index, with 0 standing for the empty
+    // string. Interning locks one of several shards, picked by the string's hash; looking a string up by its
+    // index does not lock at all, as long as the index was obtained in a way that synchronizes with its
+    // interning.
+    class string_table
+    {
+    public:
+        string_table()
+        {
+            _strings.ensure(0);
+        }
+
+        string_table(const string_table &) = delete;
+        string_table & operator=(const string_table &) = delete;
+
+        std::size_t intern(std::string_view str)
+        {
+            if (str.empty())
+            {
+                return 0;
+            }
+
+            auto & shard = _shards[std::hash<std::string_view>()(str) % _shard_count];
+            std::lock_guard<std::mutex> lock{ shard.mutex };
+
+            auto it = shard.ids.find(str);
+            if (it != shard.ids.end())
+            {
+                return it->second;
+            }
+
+            auto id = _count.fetch_add(1, std::memory_order_relaxed);
+            auto & stored = _strings.ensure(id);
+            stored = str;
+            shard.ids.emplace(stored, id);
+            return id;
+        }
+
+        const std::string & operator[](std::size_t id) const
+        {
+            return _strings[id];
+        }
+
+        // The number of ids handed out so far, counting the empty string's.
+        std::size_t size() const
+        {
+            return _count.load(std::memory_order_acquire);
+        }
+
+    private:
+        static constexpr std::size_t _shard_count = 16;
+
+        struct alignas(64) shard
+        {
+            std::mutex mutex;
+            // The keys view the strings in _strings, which never move.
+            std::unordered_map<std::string_view, std::size_t> ids;
+        };
+
+        shard _shards[_shard_count];
+        std::atomic<std::size_t> _count = 1;
+        segmented_vector<std::string> _strings;
+    };
+
+    inline std::size_t this_thread_lock_shard()
+    {
+        static std::atomic<std::size_t> next_shard = 0;
+        static thread_local std::size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed);
+        return shard;
+    }
+
+    // A reader-writer lock split into per-thread shards: readers only touch the shard of their own thread, so
+    // they do not contend with each other, while a writer has to take every shard. Meets the SharedMutex
+    // requirements. A thread must not ask for exclusive ownership while it holds shared ownership.
+    class sharded_shared_mutex
+    {
+    public:
+        sharded_shared_mutex()
+            : _shard_count{ std::bit_ceil(std::max<std::size_t>(std::thread::hardware_concurrency(), 1)) },
+              _shards{ std::make_unique<shard[]>(_shard_count) }
+        {
+        }
+
+        void lock()
+        {
+            for (std::size_t i = 0; i < _shard_count; ++i)
+            {
+                _shards[i].mutex.lock();
+            }
+        }
+
+        void unlock()
+        {
+            for (std::size_t i = _shard_count; i-- > 0;)
+            {
+                _shards[i].mutex.unlock();
+            }
+        }
+
+        void lock_shared()
+        {
+            _own_shard().lock_shared();
+        }
+
+        void unlock_shared()
+        {
+            _own_shard().unlock_shared();
+        }
+
+    private:
+        struct alignas(64) shard
+        {
+            std::shared_mutex mutex;
+        };
+
+        std::shared_mutex & _own_shard()
+        {
+            return _shards[this_thread_lock_shard() & (_shard_count - 1)].mutex;
+        }
+
+        std::size_t _shard_count;
+        std::unique_ptr<shard[]> _shards;
+    };
+}
+}
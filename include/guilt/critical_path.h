@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "graph.h"
+#include "profiling.h"
+
+namespace guilt
+{
+// Durations in nanoseconds, keyed by node. Nodes without an entry take no time.
+using node_durations = std::unordered_map<node_id, std::uint64_t, node_id_hash>;
+
+// Sums, for every region recorded by the profiler, the time it was running: from its beginning or a
+// resumption to the following suspension or its end. The time is attributed to the region's begin node.
+inline node_durations durations_from_profile(const profiler & p)
+{
+    std::unordered_map<node_id, std::vector<trace_event>, node_id_hash> events_of;
+    p.for_each_event([&](std::size_t, const trace_event & event) { events_of[event.node].push_back(event); });
+
+    node_durations ret;
+    for (auto && [node, events] : events_of)
+    {
+        // A region may be resumed on another thread than the one it was suspended on.
+        std::stable_sort(
+            events.begin(), events.end(), [](auto && a, auto && b) { return a.timestamp < b.timestamp; });
+
+        std::uint64_t total = 0;
+        std::optional<std::uint64_t> running_since;
+        for (auto && event : events)
+        {
+            switch (event.kind)
+            {
+                case trace_event_kind::region_begin:
+                case trace_event_kind::resume:
+                    running_since = event.timestamp;
+                    break;
+
+                case trace_event_kind::suspend:
+                case trace_event_kind::region_end:
+                    if (running_since)
+                    {
+                        total += event.timestamp - *running_since;
+                        running_since.reset();
+                    }
+                    break;
+            }
+        }
+
+        ret[node] = total;
+    }
+
+    return ret;
+}
+
+// The result of analyze_critical_path(). Per-node vectors are indexed by node_id::id.
+struct critical_path_analysis
+{
+    // The nodes that were analyzed, i.e. all of those the graph had not reclaimed.
+    std::vector<node_id> nodes;
+    // The longest chain of dependent nodes, weighted by their durations, in dependency order.
+    std::vector<node_id> path;
+    // The summed durations of the path, i.e. the shortest possible runtime with unlimited parallelism.
+    std::uint64_t length = 0;
+    // The summed durations of all nodes, i.e. the runtime without any parallelism.
+    std::uint64_t total_work = 0;
+
+    std::vector<std::uint64_t> durations;
+    std::vector<std::uint64_t> earliest_start;
+    // How much a node can be delayed without delaying the whole graph; zero along the critical path.
+    std::vector<std::uint64_t> slack;
+
+    double speedup() const
+    {
+        return length ? static_cast<double>(total_work) / length : 1.0;
+    }
+
+    // Marks the critical path, and notes the duration and slack of every node that took any time.
+    graphviz_highlight highlight() const
+    {
+        graphviz_highlight ret{ path, {} };
+        for (auto id : nodes)
+        {
+            if (durations[id.id])
+            {
+                std::ostringstream note;
+                note << "duration " << durations[id.id] << " ns, slack " << slack[id.id] << " ns";
+                ret.notes.emplace(id, note.str());
+            }
+        }
+        return ret;
+    }
+
+    void write_json(std::ostream & os, const dependency_graph & graph) const
+    {
+        os << "{\n    \"length\": " << length << ",\n    \"total_work\": " << total_work
+           << ",\n    \"speedup\": " << speedup() << ",\n    \"critical_path\": [";
+        for (std::size_t i = 0; i < path.size(); ++i)
+        {
+            os << (i ? ", " : " ") << path[i].id << (i + 1 == path.size() ? " " : "");
+        }
+        os << "],\n    \"nodes\": [";
+        for (std::size_t i = 0; i < nodes.size(); ++i)
+        {
+            auto id = nodes[i];
+            os << (i ? ",\n" : "\n") << "        { \"node\": " << id.id << ", \"name\": ";
+            detail::write_json_string(os, graph.node_name(id));
+            os << ", \"duration\": " << durations[id.id] << ", \"earliest_start\": " << earliest_start[id.id]
+               << ", \"slack\": " << slack[id.id] << " }";
+        }
+        os << "\n    ]\n}\n";
+    }
+
+    std::string to_json(const dependency_graph & graph) const
+    {
+        std::ostringstream os;
+        write_json(os, graph);
+        return os.str();
+    }
+};
+
+// Schedules every node of the graph as early as its predecessors allow, given duration_of(node_id) in
+// nanoseconds, and finds the chain that bounds the total runtime. Race edges count like any other: a
+// when_any is assumed to wait for all of its inputs, which overestimates the path through it.
+template<std::invocable<node_id> Durations>
+critical_path_analysis analyze_critical_path(const dependency_graph & graph, Durations && duration_of)
+{
+    auto adjacency = graph.compact();
+    auto count = adjacency.node_count();
+
+    critical_path_analysis ret;
+    ret.nodes.assign(adjacency.nodes().begin(), adjacency.nodes().end());
+    ret.durations.resize(count);
+    ret.earliest_start.resize(count);
+    ret.slack.resize(count);
+
+    // The graph is kept acyclic, so every node ends up in the order.
+    std::vector<node_id> order;
+    order.reserve(count);
+    std::vector<std::size_t> pending(count);
+    for (auto id : ret.nodes)
+    {
+        ret.durations[id.id] = duration_of(id);
+        ret.total_work += ret.durations[id.id];
+        pending[id.id] = adjacency.predecessors(id).size();
+        if (!pending[id.id])
+        {
+            order.push_back(id);
+        }
+    }
+    for (std::size_t i = 0; i < order.size(); ++i)
+    {
+        for (auto successor : adjacency.successors(order[i]))
+        {
+            if (!--pending[successor.id])
+            {
+                order.push_back(successor);
+            }
+        }
+    }
+
+    auto earliest_finish = [&](node_id id) { return ret.earliest_start[id.id] + ret.durations[id.id]; };
+
+    std::optional<node_id> last;
+    for (auto id : order)
+    {
+        for (auto successor : adjacency.successors(id))
+        {
+            auto & start = ret.earliest_start[successor.id];
+            start = std::max(start, earliest_finish(id));
+        }
+        if (!last || earliest_finish(id) >= earliest_finish(*last))
+        {
+            last = id;
+        }
+    }
+    if (!last)
+    {
+        return ret;
+    }
+    ret.length = earliest_finish(*last);
+
+    std::vector<std::uint64_t> latest_finish(count, ret.length);
+    for (auto it = order.rbegin(); it != order.rend(); ++it)
+    {
+        auto latest_start = latest_finish[it->id] - ret.durations[it->id];
+        ret.slack[it->id] = latest_start - ret.earliest_start[it->id];
+        for (auto predecessor : adjacency.predecessors(*it))
+        {
+            latest_finish[predecessor.id] = std::min(latest_finish[predecessor.id], latest_start);
+        }
+    }
+
+    // Walks back from the node finishing last, through predecessors that finish exactly when it can start.
+    for (std::optional<node_id> id = last; id;)
+    {
+        ret.path.push_back(*id);
+        auto predecessors = adjacency.predecessors(*id);
+        auto critical = std::find_if(
+            predecessors.begin(),
+            predecessors.end(),
+            [&](node_id p) { return earliest_finish(p) == ret.earliest_start[id->id] && !ret.slack[p.id]; });
+        id = critical == predecessors.end() ? std::nullopt : std::optional<node_id>{ *critical };
+    }
+    std::reverse(ret.path.begin(), ret.path.end());
+
+    return ret;
+}
+
+inline critical_path_analysis analyze_critical_path(
+    const dependency_graph & graph, const node_durations & durations)
+{
+    return analyze_critical_path(
+        graph,
+        [&](node_id id)
+        {
+            auto it = durations.find(id);
+            return it == durations.end() ? std::uint64_t(0) : it->second;
+        });
+}
+}
@@ -0,0 +1,368 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace guilt
+{
+namespace detail
+{
+    // Size-class pool for coroutine frames. Every thread keeps a free list per size class; when one grows too
+    // long, a batch of blocks is moved to a shared depot, which is also where an empty free list is refilled
+    // from. Blocks are allocated individually, so they can be freed by any thread; the depot keeps at most
+    // max_depot_batches batches per size class and frees the blocks of any batch beyond that, so what a peak
+    // in frame usage leaves behind is bounded. trim() frees everything the depot holds.
+    class frame_pool
+    {
+    public:
+        static constexpr std::size_t granularity = 64;
+        static constexpr std::size_t max_pooled_size = 4096;
+        static constexpr std::size_t class_count = max_pooled_size / granularity;
+        static constexpr std::size_t batch_size = 32;
+        static constexpr std::size_t max_cached = 4 * batch_size;
+        static constexpr std::size_t max_depot_batches = 16;
+
+        static void * allocate(std::size_t size)
+        {
+            if (size > max_pooled_size)
+            {
+                return ::operator new(size);
+            }
+
+            auto index = _class_index(size);
+            auto cache = _cache();
+            if (!cache)
+            {
+                return ::operator new(_class_size(index));
+            }
+
+            auto & list = cache->lists[index];
+            if (!list.head)
+            {
+                _depot().take(index, list);
+            }
+
+            if (!list.head)
+            {
+                return ::operator new(_class_size(index));
+            }
+
+            auto block = list.head;
+            list.head = block->next;
+            --list.count;
+            return block;
+        }
+
+        static void deallocate(void * ptr, std::size_t size)
+        {
+            if (size > max_pooled_size)
+            {
+                ::operator delete(ptr);
+                return;
+            }
+
+            auto cache = _cache();
+            if (!cache)
+            {
+                ::operator delete(ptr);
+                return;
+            }
+
+            auto index = _class_index(size);
+            auto & list = cache->lists[index];
+            list.head = ::new (ptr) free_block{ list.head };
+            ++list.count;
+
+            if (list.count > max_cached)
+            {
+                _depot().give(index, list, batch_size);
+            }
+        }
+
+        // Frees the blocks kept by the depot. Those cached by threads stay there until they overflow into the
+        // depot again, or the thread exits.
+        static void trim()
+        {
+            _depot().trim();
+        }
+
+    private:
+        struct free_block
+        {
+            free_block * next;
+        };
+
+        struct free_list
+        {
+            free_block * head = nullptr;
+            std::size_t count = 0;
+        };
+
+        static std::size_t _class_index(std::size_t size)
+        {
+            return size ? (size - 1) / granularity : 0;
+        }
+
+        static std::size_t _class_size(std::size_t index)
+        {
+            return (index + 1) * granularity;
+        }
+
+        class depot
+        {
+        public:
+            void take(std::size_t index, free_list & list)
+            {
+                std::lock_guard<std::mutex> lock{ _mutex };
+                auto & batches = _batches[index];
+                if (!batches.empty())
+                {
+                    list = batches.back();
+                    batches.pop_back();
+                }
+            }
+
+            void give(std::size_t index, free_list & list, std::size_t count)
+            {
+                free_list batch;
+                while (list.head && batch.count < count)
+                {
+                    auto block = list.head;
+                    list.head = block->next;
+                    --list.count;
+
+                    block->next = batch.head;
+                    batch.head = block;
+                    ++batch.count;
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock{ _mutex };
+                    if (_batches[index].size() < max_depot_batches)
+                    {
+                        _batches[index].push_back(batch);
+                        return;
+                    }
+                }
+
+                _free(batch);
+            }
+
+            void trim()
+            {
+                std::vector<free_list> batches;
+                for (auto & list : _batches)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock{ _mutex };
+                        batches.swap(list);
+                    }
+
+                    for (auto & batch : batches)
+                    {
+                        _free(batch);
+                    }
+                    batches.clear();
+                }
+            }
+
+        private:
+            static void _free(free_list & list)
+            {
+                while (list.head)
+                {
+                    ::operator delete(std::exchange(list.head, list.head->next));
+                }
+                list.count = 0;
+            }
+
+            std::mutex _mutex;
+            std::vector<free_list> _batches[class_count];
+        };
+
+        enum class cache_state
+        {
+            unused,
+            alive,
+            destroyed
+        };
+
+        static inline thread_local cache_state _cache_state = cache_state::unused;
+
+        struct thread_cache
+        {
+            thread_cache()
+            {
+                _cache_state = cache_state::alive;
+            }
+
+            thread_cache(const thread_cache &) = delete;
+            thread_cache & operator=(const thread_cache &) = delete;
+
+            ~thread_cache()
+            {
+                _cache_state = cache_state::destroyed;
+                for (std::size_t i = 0; i < class_count; ++i)
+                {
+                    while (lists[i].head)
+                    {
+                        _depot().give(i, lists[i], batch_size);
+                    }
+                }
+            }
+
+            free_list lists[class_count];
+        };
+
+        // Never destroyed: thread caches flush into it on thread exit, which can happen after static
+        // destructors.
+        static depot & _depot()
+        {
+            static auto instance = new depot;
+            return *instance;
+        }
+
+        // Frames can still be freed during thread teardown, after the cache is gone (e.g. by destructors of
+        // static tasks); those bypass the pool.
+        static thread_cache * _cache()
+        {
+            if (_cache_state == cache_state::destroyed)
+            {
+                return nullptr;
+            }
+
+            static thread_local thread_cache instance;
+            return &instance;
+        }
+    };
+
+    using frame_deallocate_fn = void (*)(void *, std::size_t);
+
+    constexpr std::size_t align_frame_offset(std::size_t offset, std::size_t alignment)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    // Every frame is followed by a pointer to the function that knows how to free it, since a promise's
+    // operator delete cannot tell which of its operator news allocated the frame.
+    constexpr std::size_t frame_trailer_offset(std::size_t size)
+    {
+        return align_frame_offset(size, alignof(frame_deallocate_fn));
+    }
+
+    inline void store_frame_deallocate(void * frame, std::size_t size, frame_deallocate_fn fn)
+    {
+        ::new (static_cast<std::byte *>(frame) + frame_trailer_offset(size)) frame_deallocate_fn{ fn };
+    }
+
+    struct pooled_frame
+    {
+        static std::size_t total_size(std::size_t size)
+        {
+            return frame_trailer_offset(size) + sizeof(frame_deallocate_fn);
+        }
+
+        static void * allocate(std::size_t size)
+        {
+            auto frame = frame_pool::allocate(total_size(size));
+            store_frame_deallocate(frame, size, &deallocate);
+            return frame;
+        }
+
+        static void deallocate(void * frame, std::size_t size)
+        {
+            frame_pool::deallocate(frame, total_size(size));
+        }
+    };
+
+    // Frames allocated through a user supplied allocator also carry a copy of it, rebound to a type aligned
+    // like operator new's memory, after the deallocation function.
+    template<typename Alloc>
+    struct allocator_frame
+    {
+        struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) block
+        {
+            std::byte data[__STDCPP_DEFAULT_NEW_ALIGNMENT__];
+        };
+
+        using block_allocator = typename std::allocator_traits<Alloc>::template rebind_alloc<block>;
+        using traits = std::allocator_traits<block_allocator>;
+
+        static std::size_t allocator_offset(std::size_t size)
+        {
+            return align_frame_offset(
+                frame_trailer_offset(size) + sizeof(frame_deallocate_fn), alignof(block_allocator));
+        }
+
+        static std::size_t block_count(std::size_t size)
+        {
+            return (allocator_offset(size) + sizeof(block_allocator) + sizeof(block) - 1) / sizeof(block);
+        }
+
+        static void * allocate(const Alloc & alloc, std::size_t size)
+        {
+            block_allocator allocator{ alloc };
+            void * frame = std::to_address(traits::allocate(allocator, block_count(size)));
+
+            auto stored = static_cast<std::byte *>(frame) + allocator_offset(size);
+            ::new (stored) block_allocator{ std::move(allocator) };
+            store_frame_deallocate(frame, size, &deallocate);
+            return frame;
+        }
+
+        static void deallocate(void * frame, std::size_t size)
+        {
+            auto address = static_cast<std::byte *>(frame) + allocator_offset(size);
+            auto stored = std::launder(reinterpret_cast<block_allocator *>(address));
+            block_allocator allocator{ std::move(*stored) };
+            stored->~block_allocator();
+
+            traits::deallocate(allocator, static_cast<block *>(frame), block_count(size));
+        }
+    };
+
+    // Base for promise types. Frames come from the frame pool, unless the coroutine's parameter list starts
+    // with std::allocator_arg followed by an allocator (after the object parameter, for member coroutines),
+    // in which case that allocator is used instead.
+    class frame_allocation
+    {
+    public:
+        static void * operator new(std::size_t size)
+        {
+            return pooled_frame::allocate(size);
+        }
+
+        template<typename Alloc, typename... Args>
+        static void * operator new(
+            std::size_t size,
+            std::allocator_arg_t,
+            const Alloc & alloc,
+            const Args &...)
+        {
+            return allocator_frame<Alloc>::allocate(alloc, size);
+        }
+
+        template<typename This, typename Alloc, typename... Args>
+        static void * operator new(
+            std::size_t size,
+            const This &,
+            std::allocator_arg_t,
+            const Alloc & alloc,
+            const Args &...)
+        {
+            return allocator_frame<Alloc>::allocate(alloc, size);
+        }
+
+        static void operator delete(void * frame, std::size_t size)
+        {
+            auto fn = *std::launder(reinterpret_cast<frame_deallocate_fn *>(
+                static_cast<std::byte *>(frame) + frame_trailer_offset(size)));
+            fn(frame, size);
+        }
+    };
+}
+}
@@ -1,23 +1,77 @@
 #pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
 #include <compare>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
+#include <shared_mutex>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "concurrent_storage.h"
+
 namespace guilt
 {
 enum class edge_type
 {
     depend,
     flow,
-    fulfill
+    fulfill,
+    // One of the inputs of a when_any: only the first of them to complete is waited for.
+    race,
+    // Stands in for paths through nodes that dependency_graph::reclaim() removed.
+    summary
+};
+
+// How add_edge treats an edge that is identical to one the graph already has, i.e. has the same endpoints,
+// type, label, and source location: keep adds it again, merge counts it as another hit of the existing one.
+enum class duplicate_edges
+{
+    keep,
+    merge
+};
+
+// Makes a graph hold on to in-flight work only. Annotated tasks retire their nodes, and the clusters of their
+// functions, once their frames are destroyed; retired nodes pile up over an epoch, at the end of which
+// reclaim() removes them and hands their ids out again. Retired nodes are reclaimed once there are at least
+// min_retired of them, and at least as many as there are live ones, so that every reclaim() is paid for by
+// the nodes it frees.
+struct retention_policy
+{
+    std::size_t min_retired = 1024;
+};
+
+// How often an edge was added, and when it was added first and last, in nanoseconds since the graph was
+// created. Only graphs that merge duplicate edges record the times.
+struct edge_statistics
+{
+    std::uint64_t hits = 1;
+    std::uint64_t first_seen = 0;
+    std::uint64_t last_seen = 0;
 };
 
+// Ids of reclaimed nodes and clusters are handed out again; the generation tells the uses of an id apart.
 struct node_id
 {
     std::size_t id;
+    std::uint32_t generation = 0;
 
     auto operator<=>(const node_id &) const = default;
 };
@@ -35,9 +89,93 @@ using node_id_set = std::unordered_set<node_id, node_id_hash>;
 struct cluster_id
 {
     std::size_t id;
+    std::uint32_t generation = 0;
+};
+
+// Region nodes are named after their region; the kind supplies the "begin: " or "end: " in front of the name.
+// Cancelled nodes mark regions of tasks that stopped with operation_cancelled, and are named after the task.
+enum class node_kind
+{
+    plain,
+    region_begin,
+    region_end,
+    cancelled
+};
+
+// Where a cluster, node, or edge was created; only turned into text when the graph is exported.
+struct source_location
+{
+    const char * file_name = nullptr;
+    std::uint_least32_t line = 0;
+
+    explicit operator bool() const
+    {
+        return file_name;
+    }
+};
+
+namespace detail
+{
+    template<std::output_iterator<char> OutputIt>
+    class graphviz_writer
+    {
+    public:
+        graphviz_writer(OutputIt out) : _out{ std::move(out) }
+        {
+        }
+
+        graphviz_writer & operator<<(std::string_view str)
+        {
+            _out = std::copy(str.begin(), str.end(), std::move(_out));
+            return *this;
+        }
+
+        graphviz_writer & operator<<(std::size_t value)
+        {
+            char buffer[std::numeric_limits<std::size_t>::digits10 + 1];
+            auto result = std::to_chars(std::begin(buffer), std::end(buffer), value);
+            return *this << std::string_view(buffer, result.ptr - buffer);
+        }
+
+        graphviz_writer & indent(std::size_t depth)
+        {
+            for (std::size_t i = 0; i < depth; ++i)
+            {
+                *this << "    ";
+            }
+            return *this;
+        }
+
+        OutputIt out() const
+        {
+            return _out;
+        }
+
+    private:
+        OutputIt _out;
+    };
+}
+
+// Emphasis for a graphviz export: the nodes of path, and the edges between consecutive ones, are drawn in
+// bold, and nodes with an entry in notes get it appended to their labels.
+struct graphviz_highlight
+{
+    std::vector<node_id> path;
+    std::unordered_map<node_id, std::string, node_id_hash> notes;
 };
 
 class dependency_graph;
+class graph_snapshot;
+
+// An edge for dependency_graph::add_edges(); the members mean what the parameters of add_edge do.
+struct batch_edge
+{
+    node_id from;
+    node_id to;
+    edge_type type = edge_type::depend;
+    std::string_view label = {};
+    source_location loc = {};
+};
 
 class dependency_cycle : std::exception
 {
@@ -45,9 +183,20 @@ public:
     std::string to_graphviz() const;
     std::string full_graph_graphviz() const;
 
+    template<std::output_iterator<char> OutputIt>
+    OutputIt write_graphviz(OutputIt out) const;
+    template<std::output_iterator<char> OutputIt>
+    OutputIt write_full_graph_graphviz(OutputIt out) const;
+
+    void write_graphviz(std::ostream & os) const;
+    void write_full_graph_graphviz(std::ostream & os) const;
+
 private:
     friend class dependency_graph;
 
+    template<typename Writer>
+    void _write_cycle_edge(Writer & writer) const;
+
     dependency_cycle(const dependency_graph * graph, node_id from, node_id to, std::string label = "")
         : _graph{ graph }, _from{ from }, _to{ to }, _label{ std::move(label) }
     {
@@ -59,389 +208,1896 @@ private:
     std::string _label;
 };
 
+// All of the member functions can be called concurrently. Adding nodes, clusters, and edges that agree with
+// the graph's current topological order only takes the shared side of a sharded lock, so threads adding them
+// do not serialize each other. So does an edge against the order whose target, with the few nodes reachable
+// from it, can simply be moved behind all other nodes, such as the end of a region that a task's awaiter
+// waits on; other edges that force the order to change, and everything that reads the structure of the graph
+// as a whole, take the exclusive side.
 class dependency_graph
 {
 public:
     friend class dependency_cycle;
+    friend class graph_snapshot;
 
-    cluster_id add_cluster(std::string name, std::string description = "")
-    {
-        cluster_id ret = { _clusters.size() };
-        _clusters.push_back(cluster{ ret, std::move(name), std::move(description) });
-        return ret;
-    }
+    dependency_graph() = default;
 
-    cluster_id add_cluster(cluster_id parent, std::string name, std::string description = "")
+    // Merging keeps the size of the graph proportional to the structure of the program rather than to the
+    // number of times a shared task is awaited from the same place.
+    explicit dependency_graph(duplicate_edges duplicates)
     {
-        auto ret = add_cluster(std::move(name), std::move(description));
-        _clusters.at(parent.id).child_clusters.push_back(ret);
-        _clusters[ret.id].parent = parent;
-        return ret;
+        if (duplicates == duplicate_edges::merge)
+        {
+            _edge_index = std::make_unique<edge_index_shard[]>(_edge_index_shard_count);
+        }
     }
 
-    node_id add_node(std::string name, std::string description = "")
+    explicit dependency_graph(retention_policy retention, duplicate_edges duplicates = duplicate_edges::keep)
+        : dependency_graph(duplicates)
     {
-        node_id ret = { _nodes.size() };
-        _nodes.push_back(node{ ret, std::move(name), std::move(description) });
-        return ret;
+        _retention = retention;
     }
 
-    node_id add_node(cluster_id parent, std::string name, std::string description = "")
+    dependency_graph(const dependency_graph &) = delete;
+    dependency_graph & operator=(const dependency_graph &) = delete;
+
+    cluster_id add_cluster(std::string_view name, std::string_view description = {}, source_location loc = {})
     {
-        auto ret = add_node(std::move(name), std::move(description));
-        _clusters.at(parent.id).child_nodes.push_back(ret);
-        return ret;
+        std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        return _add_cluster(name, description, loc);
     }
 
-    void add_edge(node_id from, node_id to, edge_type type = edge_type::depend, std::string label = "")
+    cluster_id add_cluster(
+        cluster_id parent,
+        std::string_view name,
+        std::string_view description = {},
+        source_location loc = {})
     {
-        if (_check_for_cycle(from, to))
-        {
-            throw dependency_cycle{ this, from, to, std::move(label) };
-        }
+        std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        auto & parent_cluster = _cluster_at(parent);
+
+        auto ret = _add_cluster(name, description, loc);
+        _clusters[ret.id].parent = parent;
 
-        auto e = edge{ from, to, type, std::move(label) };
-        _edges.insert(std::lower_bound(_edges.begin(), _edges.end(), e), e);
+        std::lock_guard<detail::spin_lock> children_lock{ parent_cluster.lock };
+        parent_cluster.child_clusters.push_back(ret);
+        return ret;
     }
 
-    struct graph_filter_between
+    node_id add_node(
+        std::string_view name,
+        std::string_view description = {},
+        source_location loc = {},
+        node_kind kind = node_kind::plain)
     {
-        node_id from;
-        node_id to;
-    };
+        std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        return _add_node(name, description, loc, kind);
+    }
 
-    std::string to_graphviz() const
+    node_id add_node(
+        cluster_id parent,
+        std::string_view name,
+        std::string_view description = {},
+        source_location loc = {},
+        node_kind kind = node_kind::plain)
     {
-        std::string ret;
+        std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        auto & parent_cluster = _cluster_at(parent);
 
-        ret += _graphviz_header();
-        ret += _generate_graphviz();
-        ret += _graphviz_footer();
+        auto ret = _add_node(name, description, loc, kind);
 
+        std::lock_guard<detail::spin_lock> children_lock{ parent_cluster.lock };
+        parent_cluster.child_nodes.push_back(ret);
         return ret;
     }
 
-    std::string to_graphviz(graph_filter_between filter) const
+    // An edge from or to a reclaimed node is dropped: the node was retired, so its work is complete, and
+    // summary edges keep whatever it connected.
+    void add_edge(
+        node_id from,
+        node_id to,
+        edge_type type = edge_type::depend,
+        std::string_view label = {},
+        source_location loc = {})
     {
-        std::string ret;
+        {
+            // Under the shared lock, positions in the order only ever grow, and only those of nodes that are
+            // moved to the end along with everything reachable from them; an edge that agrees with the order
+            // cannot close a cycle, as long as it still does once `from` is locked against being moved.
+            std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+            _check_node(from);
+            _check_node(to);
+            if (!_is_current(from) || !_is_current(to))
+            {
+                return;
+            }
+            if ((_order_of(from.id) < _order_of(to.id) || _move_to_end(from.id, to.id))
+                && _insert_edge(from, to, type, label, loc, std::nullopt, true))
+            {
+                return;
+            }
+        }
 
-        ret += _graphviz_header();
-        ret += _generate_graphviz(_get_filtered_nodes(filter));
-        ret += _graphviz_footer();
+        std::unique_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        if (!_is_current(from) || !_is_current(to))
+        {
+            return;
+        }
+        if (!_update_order(from, to))
+        {
+            std::string text;
+            detail::graphviz_writer writer{ std::back_inserter(text) };
+            _write_edge_label(writer, _strings.intern(label), loc);
+            throw dependency_cycle{ this, from, to, std::move(text) };
+        }
 
-        return ret;
+        _insert_edge(from, to, type, label, loc);
     }
 
-private:
-    std::string _graphviz_header() const
+    // Adds many edges at once. Instead of checking each of them against the topological order, one pass over
+    // the whole graph finds its strongly connected components with the batch included, which pays off for
+    // batches that are large compared to the graph, or that mostly disagree with its current order. An edge
+    // that closes a cycle is left out, exactly as if the edges had been added one by one and add_edge had
+    // thrown for it; the cycles are returned, in the order of the edges that closed them. Edges from or to
+    // reclaimed nodes are dropped, as by add_edge.
+    [[nodiscard]] std::vector<dependency_cycle> add_edges(std::span<const batch_edge> edges)
     {
-        return
-            R"header(
-digraph {
-    rankdir = "TB";
-    newrank = "true";
+        std::unique_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        bool stale = false;
+        for (auto && edge : edges)
+        {
+            _check_node(edge.from);
+            _check_node(edge.to);
+            stale = stale || !_is_current(edge.from) || !_is_current(edge.to);
+        }
 
-)header";
+        std::vector<batch_edge> current;
+        if (stale)
+        {
+            std::copy_if(
+                edges.begin(),
+                edges.end(),
+                std::back_inserter(current),
+                [&](const batch_edge & edge) { return _is_current(edge.from) && _is_current(edge.to); });
+            edges = current;
+        }
+
+        // A batch that agrees with the current order needs no pass at all.
+        auto agrees = std::all_of(
+            edges.begin(),
+            edges.end(),
+            [&](const batch_edge & edge)
+            { return _order_of(edge.from.id) < _order_of(edge.to.id); });
+        auto rejected = agrees ? std::vector<bool>(edges.size()) : _order_with(edges);
+
+        std::vector<dependency_cycle> cycles;
+        for (std::size_t i = 0; i < edges.size(); ++i)
+        {
+            auto & edge = edges[i];
+            if (!rejected[i])
+            {
+                _insert_edge(edge.from, edge.to, edge.type, edge.label, edge.loc);
+                continue;
+            }
+
+            std::string text;
+            detail::graphviz_writer writer{ std::back_inserter(text) };
+            _write_edge_label(writer, _strings.intern(edge.label), edge.loc);
+            cycles.push_back(dependency_cycle{ this, edge.from, edge.to, std::move(text) });
+        }
+
+        return cycles;
     }
 
-    std::string _graphviz_footer() const
+    duplicate_edges duplicates() const
     {
-        return "}";
+        return _edge_index ? duplicate_edges::merge : duplicate_edges::keep;
     }
 
-    std::string _generate_graphviz() const
+    const std::optional<retention_policy> & retention() const
     {
-        std::string ret;
+        return _retention;
+    }
 
-        for (auto && node : _nodes)
+    // Marks nodes whose work is complete, and into which no more edges will be added, to be removed by the
+    // next reclaim(). Until then, they stay in the graph, and in their clusters, like any other node.
+    void retire(std::span<const node_id> nodes)
+    {
         {
-            auto id_str = std::to_string(node.id.id);
-            ret += "    node_" + id_str + " [ label = \"" + node.name + " (#" + id_str + ")\n"
-                + node.description + "\" ];\n";
+            std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+            std::size_t retired = 0;
+            for (auto && id : nodes)
+            {
+                _check_node(id);
+                if (_is_current(id) && !_nodes[id.id].retired.exchange(true, std::memory_order_relaxed))
+                {
+                    ++retired;
+                }
+            }
+            _retired_count.fetch_add(retired, std::memory_order_relaxed);
         }
 
-        ret += "\n";
-
-        auto print_cluster = [&](auto && self, const cluster & c, std::string prefix) -> void
+        // Whoever finds a reclaim due does it; everybody else goes on retiring in the meantime.
+        if (_retention && _reclaim_due() && !_reclaiming.exchange(true, std::memory_order_acquire))
         {
-            auto id_str = std::to_string(c.id.id);
-
-            ret += prefix + "subgraph cluster_" + id_str + " {\n";
-            ret += prefix + "    label = \"" + c.name + " (#" + id_str + ")"
-                + (c.description.empty() ? "" : "\\n") + c.description + "\";\n\n";
-
-            for (auto && child : c.child_clusters)
-            {
-                self(self, _clusters.at(child.id), prefix + "    ");
-            }
+            reclaim();
+            _reclaiming.store(false, std::memory_order_release);
+        }
+    }
 
-            for (auto && child : c.child_nodes)
-            {
-                ret += prefix + "    node_" + std::to_string(child.id) + ";\n";
-            }
+    // A retired cluster is removed once all of its nodes and child clusters have been.
+    void retire(cluster_id id)
+    {
+        std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        _cluster_at(id).retired.store(true, std::memory_order_relaxed);
+    }
 
-            ret += prefix + "}\n";
-        };
+    // Removes all retired nodes, with their edges, and the retired clusters left empty; returns the number of
+    // nodes removed. Reachability among the remaining nodes is kept as it was: for every path that led from
+    // one of them to another through removed nodes only, a summary edge is added, unless an edge between the
+    // two already exists. That way, an edge added later closes a cycle exactly when it would have before.
+    std::size_t reclaim()
+    {
+        std::unique_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        auto count = _node_slots();
 
-        for (auto && cluster : _clusters)
+        std::vector<bool> removed(count);
+        std::vector<std::size_t> removed_ids;
+        for (std::size_t i = 0; i < count; ++i)
         {
-            if (cluster.parent)
+            if (!_nodes[i].free && _nodes[i].retired.load(std::memory_order_relaxed))
             {
-                continue;
+                removed[i] = true;
+                removed_ids.push_back(i);
             }
+        }
 
-            print_cluster(print_cluster, cluster, "    ");
+        if (!removed_ids.empty())
+        {
+            _remove_nodes(removed, removed_ids);
         }
+        _remove_clusters();
 
-        ret += "\n";
+        _retired_count.fetch_sub(removed_ids.size(), std::memory_order_relaxed);
+        return removed_ids.size();
+    }
 
-        for (auto && edge : _edges)
-        {
-            const char * style = nullptr;
-            switch (edge.type)
-            {
-                case edge_type::depend:
-                    style = "dir = \"back\"";
-                    break;
+    // The nodes and edges in the graph, not counting reclaimed ones. Only a snapshot while others add to it.
+    std::size_t node_count() const
+    {
+        auto free = _free_nodes.size.load(std::memory_order_relaxed);
+        return _node_slots() - free;
+    }
 
-                case edge_type::flow:
-                    style = "style = \"dashed\" arrowhead = \"dot\"";
-                    break;
+    std::size_t edge_count() const
+    {
+        auto free = _free_edges.size.load(std::memory_order_relaxed);
+        return _edge_slots() - free;
+    }
 
-                case edge_type::fulfill:
-                    style = "arrowhead = \"vee\"";
-                    break;
-            }
+    // Whether the node exists and has not been reclaimed.
+    bool contains(node_id id) const
+    {
+        std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        return id.id < _node_slots() && _is_current(id);
+    }
 
-            ret += "    node_" + std::to_string(edge.from.id) + " -> node_" + std::to_string(edge.to.id)
-                + " [ " + style + " label = \"" + edge.label + "\" ];\n";
-        }
+    bool contains(cluster_id id) const
+    {
+        std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        return id.id < _cluster_count.load(std::memory_order_acquire)
+            && _clusters[id.id].id.generation == id.generation;
+    }
 
+    // The name of the node as it appears in exports, including the prefix of region nodes.
+    std::string node_name(node_id id) const
+    {
+        std::string ret;
+        std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        _check_current(id);
+        _write_node_name(detail::graphviz_writer{ std::back_inserter(ret) }, _node_details[id.id]);
         return ret;
     }
 
-    std::string _generate_graphviz(node_id_set filtered_node_ids) const
+    const std::string & cluster_name(cluster_id id) const
     {
-        std::string ret;
+        std::shared_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        return _strings[_cluster_at(id).name];
+    }
 
-        for (auto && node_id : filtered_node_ids)
+    // A compressed sparse row copy of the graph's structure: the successors and predecessors of each node are
+    // stored contiguously, and all of them in just two arrays per direction. Meant for analyses that traverse
+    // the graph many times; it does not see edges added after it was taken.
+    class compact_adjacency
+    {
+    public:
+        // The number of slots, including those of reclaimed nodes.
+        std::size_t node_count() const
         {
-            auto id_str = std::to_string(node_id.id);
-            ret += "    node_" + id_str + " [ label = \"" + _nodes[node_id.id].name + " (#" + id_str + ")\n"
-                + _nodes[node_id.id].description + "\" ];\n";
+            return _successor_offsets.size() - 1;
         }
 
-        ret += "\n";
-
-        auto print_cluster = [&](auto && self, const cluster & c, std::string prefix) -> void
+        // The nodes that have not been reclaimed, by id; the slots of reclaimed ones have no edges.
+        std::span<const node_id> nodes() const
         {
-            auto id_str = std::to_string(c.id.id);
+            return _nodes;
+        }
 
-            ret += prefix + "subgraph cluster_" + id_str + " {\n";
-            ret += prefix + "    label = \"" + c.name + " (#" + id_str + ")\\n" + c.description + "\";\n\n";
+        std::span<const node_id> successors(node_id id) const
+        {
+            return { _successors.data() + _successor_offsets[id.id],
+                     _successors.data() + _successor_offsets[id.id + 1] };
+        }
 
-            for (auto && child : c.child_clusters)
-            {
-                self(self, _clusters.at(child.id), prefix + "    ");
-            }
+        std::span<const node_id> predecessors(node_id id) const
+        {
+            return { _predecessors.data() + _predecessor_offsets[id.id],
+                     _predecessors.data() + _predecessor_offsets[id.id + 1] };
+        }
 
-            for (auto && child : c.child_nodes)
-            {
-                if (filtered_node_ids.find(child) != filtered_node_ids.end())
-                {
-                    ret += prefix + "    node_" + std::to_string(child.id) + ";\n";
-                }
-            }
+    private:
+        friend class dependency_graph;
 
-            ret += prefix + "}\n";
-        };
+        std::vector<node_id> _nodes;
+        std::vector<std::size_t> _successor_offsets;
+        std::vector<node_id> _successors;
+        std::vector<std::size_t> _predecessor_offsets;
+        std::vector<node_id> _predecessors;
+    };
 
-        for (auto && cluster : _clusters)
+    compact_adjacency compact() const
+    {
+        std::unique_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        compact_adjacency ret;
+        for (std::size_t i = 0; i < _node_slots(); ++i)
         {
-            if (cluster.parent)
+            if (!_nodes[i].free)
             {
-                continue;
+                ret._nodes.push_back(_id_at(i));
             }
-
-            print_cluster(print_cluster, cluster, "    ");
         }
 
-        ret += "\n";
-
-        for (auto && edge : _edges)
+        auto flatten = [&](auto && offsets, auto && targets, auto && list_of)
         {
-            if (filtered_node_ids.find(edge.from) != filtered_node_ids.end()
-                && filtered_node_ids.find(edge.to) != filtered_node_ids.end())
+            auto count = _node_slots();
+            offsets.reserve(count + 1);
+            targets.reserve(edge_count());
+
+            offsets.push_back(0);
+            for (std::size_t i = 0; i < count; ++i)
             {
-                const char * style = nullptr;
-                switch (edge.type)
+                for (auto && adjacent : list_of(_nodes[i]))
                 {
-                    case edge_type::depend:
-                        style = "dir = \"back\"";
-                        break;
-
-                    case edge_type::flow:
-                        style = "style = \"dashed\" arrowhead = \"dot\"";
-                        break;
-
-                    case edge_type::fulfill:
-                        style = "arrowhead = \"vee\"";
-                        break;
+                    targets.push_back(_id_at(adjacent.node));
                 }
-
-                ret += "    node_" + std::to_string(edge.from.id) + " -> node_" + std::to_string(edge.to.id)
-                    + " [ " + style + " label = \"" + edge.label + "\" ];\n";
+                offsets.push_back(targets.size());
             }
-        }
+        };
+
+        flatten(
+            ret._successor_offsets,
+            ret._successors,
+            [](auto && n) -> auto & { return n.outgoing; });
+        flatten(
+            ret._predecessor_offsets,
+            ret._predecessors,
+            [](auto && n) -> auto & { return n.incoming; });
 
         return ret;
     }
 
-    bool _check_for_cycle(node_id from, node_id to) const
+    struct graph_filter_between
     {
-        node_id_set nodes_reachable_from_to{ to };
-        node_id_set nodes_to_check{ to };
+        node_id from;
+        node_id to;
+    };
 
-        auto reachable_node = [&](node_id id)
-        {
-            if (nodes_reachable_from_to.insert(id).second)
-            {
-                nodes_to_check.insert(id);
-            }
-        };
+    std::string to_graphviz() const
+    {
+        std::string ret;
+        write_graphviz(std::back_inserter(ret));
+        return ret;
+    }
 
-        while (!nodes_to_check.empty())
-        {
-            auto b = nodes_to_check.begin();
-            auto current_from = *b;
-            nodes_to_check.erase(b);
+    std::string to_graphviz(graph_filter_between filter) const
+    {
+        std::string ret;
+        write_graphviz(std::back_inserter(ret), filter);
+        return ret;
+    }
 
-            auto [begin, end] = std::equal_range(
-                _edges.begin(),
-                _edges.end(),
-                edge{ current_from, {} },
-                [](auto && lhs, auto && rhs) { return lhs.from.id < rhs.from.id; });
+    std::string to_graphviz(const graphviz_highlight & highlight) const
+    {
+        std::string ret;
+        write_graphviz(std::back_inserter(ret), highlight);
+        return ret;
+    }
 
-            while (begin != end)
-            {
-                auto current_to = (begin++)->to;
+    // The write_graphviz overloads emit the same documents as to_graphviz, straight into a stream or through
+    // an output iterator of char, without building the document in memory first. Only the structure of the
+    // graph is copied under the lock; the document is written after releasing it, so that a slow stream does
+    // not hold up the threads adding to the graph.
+    template<std::output_iterator<char> OutputIt>
+    OutputIt write_graphviz(OutputIt out) const
+    {
+        std::unique_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        auto copy = _copy_for_export();
+        lock.unlock();
+
+        detail::graphviz_writer<OutputIt> writer{ out };
+        writer << _graphviz_header;
+        _write_graphviz(writer, copy, [](node_id) { return true; });
+        writer << _graphviz_footer;
+        return writer.out();
+    }
 
-                if (current_to.id == from.id)
-                {
-                    return true;
-                }
+    template<std::output_iterator<char> OutputIt>
+    OutputIt write_graphviz(OutputIt out, graph_filter_between filter) const
+    {
+        std::unique_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        auto copy = _copy_for_export();
+        auto filtered_node_ids = _get_filtered_nodes(filter);
+        lock.unlock();
+
+        detail::graphviz_writer<OutputIt> writer{ out };
+        writer << _graphviz_header;
+        _write_graphviz(writer, copy, _contained_in(filtered_node_ids));
+        writer << _graphviz_footer;
+        return writer.out();
+    }
 
-                reachable_node(current_to);
-            }
-        }
+    template<std::output_iterator<char> OutputIt>
+    OutputIt write_graphviz(OutputIt out, const graphviz_highlight & highlight) const
+    {
+        std::unique_lock<detail::sharded_shared_mutex> lock{ _mutex };
+        auto copy = _copy_for_export();
+        lock.unlock();
+
+        detail::graphviz_writer<OutputIt> writer{ out };
+        writer << _graphviz_header;
+        _write_graphviz(writer, copy, [](node_id) { return true; }, &highlight);
+        writer << _graphviz_footer;
+        return writer.out();
+    }
 
-        return false;
+    void write_graphviz(std::ostream & os) const
+    {
+        write_graphviz(std::ostreambuf_iterator<char>{ os });
     }
 
-    node_id_set _get_filtered_nodes(graph_filter_between filter) const
+    void write_graphviz(std::ostream & os, graph_filter_between filter) const
     {
-        node_id_set nodes_included{ filter.from, filter.to };
-        std::vector<std::vector<node_id>> paths_to_check{ { filter.to } };
+        write_graphviz(std::ostreambuf_iterator<char>{ os }, filter);
+    }
 
-        while (!paths_to_check.empty())
-        {
-            auto path = std::move(paths_to_check.back());
-            paths_to_check.pop_back();
+    void write_graphviz(std::ostream & os, const graphviz_highlight & highlight) const
+    {
+        write_graphviz(std::ostreambuf_iterator<char>{ os }, highlight);
+    }
 
-            auto tail_id = path.back();
+private:
+    struct node;
+    struct node_ordering;
+    struct node_details;
+    struct edge;
+    struct cluster;
+    struct export_copy;
+
+    static constexpr std::string_view _graphviz_header = R"header(
+digraph {
+    rankdir = "TB";
+    newrank = "true";
 
-            auto [begin, end] = std::equal_range(
-                _edges.begin(),
-                _edges.end(),
-                edge{ tail_id, {} },
-                [](auto && lhs, auto && rhs) { return lhs.from.id < rhs.from.id; });
+)header";
 
-            while (begin != end)
-            {
-                auto current_id = (begin++)->to;
+    static constexpr std::string_view _graphviz_footer = "}";
 
-                if (current_id == filter.to || nodes_included.find(current_id) != nodes_included.end())
-                {
-                    nodes_included.insert(path.begin(), path.end());
-                    continue;
-                }
+    static auto _contained_in(const node_id_set & node_ids)
+    {
+        return [&node_ids](node_id id) { return node_ids.find(id) != node_ids.end(); };
+    }
+
+    static constexpr std::string_view _highlight_style = " color = \"red\" penwidth = \"2\"";
 
-                paths_to_check.push_back(path);
-                paths_to_check.back().push_back(current_id);
+    // Has to be called under the exclusive lock.
+    export_copy _copy_for_export() const
+    {
+        export_copy ret;
+        for (std::size_t i = 0; i < _node_slots(); ++i)
+        {
+            if (!_nodes[i].free)
+            {
+                ret.nodes.push_back(_id_at(i));
+                ret.details.push_back(_node_details[i]);
             }
         }
 
-        return nodes_included;
+        for (std::size_t i = 0; i < _cluster_count.load(std::memory_order_acquire); ++i)
+        {
+            auto & c = _clusters[i];
+            ret.clusters.push_back(cluster_copy{
+                c.id, c.name, c.description, c.loc, c.child_clusters, c.child_nodes, !c.parent && !c.free });
+        }
+
+        ret.edges.reserve(edge_count());
+        _for_each_edge([&](const edge & edge) { ret.edges.push_back(edge); });
+        return ret;
     }
 
-    struct node
+    template<typename Writer, typename Filter>
+    void _write_graphviz(
+        Writer & writer,
+        const export_copy & copy,
+        Filter && included,
+        const graphviz_highlight * highlight = nullptr) const
     {
-        node_id id;
-        std::string name;
-        std::string description;
-
-        auto operator<=>(const node & other) const
+        // Maps every node of the highlighted path to the one following it.
+        std::unordered_map<node_id, std::optional<node_id>, node_id_hash> path;
+        if (highlight)
         {
-            return id <=> other.id;
+            for (std::size_t i = 0; i < highlight->path.size(); ++i)
+            {
+                auto & next = path[highlight->path[i]];
+                if (i + 1 < highlight->path.size())
+                {
+                    next = highlight->path[i + 1];
+                }
+            }
         }
-    };
 
-    struct edge
-    {
-        node_id from;
+        for (std::size_t i = 0; i < copy.nodes.size(); ++i)
+        {
+            auto id = copy.nodes[i];
+            if (!included(id))
+            {
+                continue;
+            }
+
+            auto & details = copy.details[i];
+            writer << "    node_" << id.id << " [ label = \"";
+            _write_node_name(writer, details);
+            writer << " (#" << id.id << ")\n";
+            _write_description(writer, details.description, details.loc);
+            if (highlight)
+            {
+                auto note = highlight->notes.find(id);
+                if (note != highlight->notes.end())
+                {
+                    writer << "\n" << note->second;
+                }
+            }
+            writer << "\"";
+            if (details.kind == node_kind::cancelled)
+            {
+                writer << " shape = \"octagon\"";
+            }
+            if (path.contains(id))
+            {
+                writer << _highlight_style;
+            }
+            writer << " ];\n";
+        }
+
+        writer << "\n";
+
+        auto print_cluster = [&](auto && self, const cluster_copy & c, std::size_t depth) -> void
+        {
+            writer.indent(depth) << "subgraph cluster_" << c.id.id << " {\n";
+            writer.indent(depth + 1) << "label = \"" << _strings[c.name] << " (#" << c.id.id << ")";
+            if (c.description || c.loc)
+            {
+                writer << "\\n";
+                _write_description(writer, c.description, c.loc);
+            }
+            writer << "\";\n\n";
+
+            for (auto && child : c.child_clusters)
+            {
+                self(self, copy.clusters[child.id], depth + 1);
+            }
+
+            for (auto && child : c.child_nodes)
+            {
+                if (included(child))
+                {
+                    writer.indent(depth + 1) << "node_" << child.id << ";\n";
+                }
+            }
+
+            writer.indent(depth) << "}\n";
+        };
+
+        for (auto && cluster : copy.clusters)
+        {
+            if (cluster.top_level)
+            {
+                print_cluster(print_cluster, cluster, 1);
+            }
+        }
+
+        writer << "\n";
+
+        for (auto && edge : copy.edges)
+        {
+            if (!included(edge.from) || !included(edge.to))
+            {
+                continue;
+            }
+
+            const char * style = nullptr;
+            switch (edge.type)
+            {
+                case edge_type::depend:
+                    style = "dir = \"back\"";
+                    break;
+
+                case edge_type::flow:
+                    style = "style = \"dashed\" arrowhead = \"dot\"";
+                    break;
+
+                case edge_type::fulfill:
+                    style = "arrowhead = \"vee\"";
+                    break;
+
+                case edge_type::race:
+                    style = "dir = \"back\" style = \"dotted\"";
+                    break;
+
+                case edge_type::summary:
+                    style = "dir = \"back\" color = \"gray\"";
+                    break;
+            }
+
+            writer << "    node_" << edge.from.id << " -> node_" << edge.to.id << " [ " << style
+                   << " label = \"";
+            _write_edge_label(writer, edge.label, edge.loc);
+            if (edge.statistics.hits > 1)
+            {
+                writer << (edge.label || edge.loc ? " (" : "(") << edge.statistics.hits << " hits)";
+            }
+            writer << "\"";
+            auto on_path = path.find(edge.from);
+            if (on_path != path.end() && on_path->second == edge.to)
+            {
+                writer << _highlight_style;
+            }
+            writer << " ];\n";
+        }
+    }
+
+    template<typename Writer>
+    void _write_node_name(Writer && writer, const node_details & details) const
+    {
+        switch (details.kind)
+        {
+            case node_kind::plain:
+                break;
+
+            case node_kind::region_begin:
+                writer << "begin: ";
+                break;
+
+            case node_kind::region_end:
+                writer << "end: ";
+                break;
+
+            case node_kind::cancelled:
+                writer << "cancelled: ";
+                break;
+        }
+
+        writer << _strings[details.name];
+    }
+
+    template<typename Writer>
+    void _write_description(Writer && writer, std::size_t description, source_location loc) const
+    {
+        if (loc)
+        {
+            writer << "at " << loc.file_name << ":" << std::size_t{ loc.line } << "\n";
+        }
+        writer << _strings[description];
+    }
+
+    template<typename Writer>
+    void _write_edge_label(Writer && writer, std::size_t label, source_location loc) const
+    {
+        writer << _strings[label];
+        if (loc)
+        {
+            writer << (label ? " at " : "at ") << loc.file_name << ":" << std::size_t{ loc.line };
+        }
+    }
+
+    // Visits edges grouped by their source node, in the order they were added.
+    template<typename F>
+    void _for_each_edge(F && f) const
+    {
+        for (std::size_t i = 0; i < _node_slots(); ++i)
+        {
+            for (auto && adjacent : _nodes[i].outgoing)
+            {
+                f(_edges[adjacent.edge]);
+            }
+        }
+    }
+
+    // Most edges against the order lead into a node that few others come after yet: the end of the region
+    // awaiting a task was created before the task's nodes, but only the ends of the regions awaiting it in
+    // turn follow it. Moving the node, and everything reachable from it, behind all other nodes in their
+    // relative order makes the edge agree with the order without searching what lies in between, and can be
+    // done under the shared lock: the moved nodes stay locked meanwhile, so no edge out of them can be added.
+    // Gives up, leaving the order untouched, if too many nodes would move, if another thread holds one of
+    // their locks, or if `from` is among them, in which case the edge closes a cycle.
+    bool _move_to_end(std::size_t from, std::size_t to)
+    {
+        std::array<ordered_node, 32> moved;
+        std::size_t count = 0;
+        auto take = [&](std::size_t index)
+        {
+            if (count == moved.size() || !_nodes[index].lock.try_lock())
+            {
+                return false;
+            }
+            moved[count++] = { _order_of(index), index };
+            return true;
+        };
+
+        auto movable = from != to && take(to);
+        for (std::size_t i = 0; movable && i < count; ++i)
+        {
+            for (auto && adjacent : _nodes[moved[i].node].outgoing)
+            {
+                auto taken = std::any_of(
+                    moved.begin(),
+                    moved.begin() + count,
+                    [&](const ordered_node & node) { return node.node == adjacent.node; });
+                if (adjacent.node == from || (!taken && !take(adjacent.node)))
+                {
+                    movable = false;
+                    break;
+                }
+            }
+        }
+
+        if (movable)
+        {
+            std::sort(
+                moved.begin(),
+                moved.begin() + count,
+                [](const ordered_node & lhs, const ordered_node & rhs) { return lhs.order < rhs.order; });
+            auto order = _next_order.fetch_add(count, std::memory_order_relaxed);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                _ordering[moved[i].node].order.store(order + i, std::memory_order_relaxed);
+            }
+        }
+
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            _nodes[moved[i].node].lock.unlock();
+        }
+        return movable;
+    }
+
+    // Incremental topological ordering, after Pearce and Kelly: order keeps a position for every node such
+    // that every edge points from a lower position to a higher one. An edge that already agrees with the
+    // order is accepted without looking at the graph; otherwise only the nodes positioned between its
+    // endpoints are searched, and those that the new edge forces to move are shuffled among their own
+    // positions.
+    //
+    // Returns false, leaving the order untouched, if the edge would close a cycle.
+    bool _update_order(node_id from, node_id to)
+    {
+        if (from == to)
+        {
+            return false;
+        }
+
+        auto lower = _order_of(to.id);
+        auto upper = _order_of(from.id);
+        if (upper < lower)
+        {
+            return true;
+        }
+
+        // Forward from `to`, through nodes positioned before `from`: reaching `from` means a cycle.
+        _forward.clear();
+        auto epoch = _next_epoch();
+        _search_stack.assign({ to.id });
+        _ordering[to.id].visited = epoch;
+
+        while (!_search_stack.empty())
+        {
+            auto current = _search_stack.back();
+            _search_stack.pop_back();
+            _forward.push_back({ _order_of(current), current });
+
+            for (auto && adjacent : _nodes[current].outgoing)
+            {
+                auto next = adjacent.node;
+                if (next == from.id)
+                {
+                    return false;
+                }
+
+                if (_ordering[next].visited != epoch && _order_of(next) < upper)
+                {
+                    _ordering[next].visited = epoch;
+                    _search_stack.push_back(next);
+                }
+            }
+        }
+
+        // Backward from `from`, through nodes positioned after `to`.
+        _backward.clear();
+        epoch = _next_epoch();
+        _search_stack.assign({ from.id });
+        _ordering[from.id].visited = epoch;
+
+        while (!_search_stack.empty())
+        {
+            auto current = _search_stack.back();
+            _search_stack.pop_back();
+            _backward.push_back({ _order_of(current), current });
+
+            for (auto && adjacent : _nodes[current].incoming)
+            {
+                auto previous = adjacent.node;
+                if (_ordering[previous].visited != epoch && _order_of(previous) > lower)
+                {
+                    _ordering[previous].visited = epoch;
+                    _search_stack.push_back(previous);
+                }
+            }
+        }
+
+        // Everything that reaches `from` has to come before everything reachable from `to`; both groups keep
+        // their relative order and reuse the positions they occupied between them.
+        // The positions are sorted along with the nodes, which keeps the sorts on contiguous memory.
+        auto by_order = [](const ordered_node & lhs, const ordered_node & rhs)
+        { return lhs.order < rhs.order; };
+        std::sort(_forward.begin(), _forward.end(), by_order);
+        std::sort(_backward.begin(), _backward.end(), by_order);
+
+        _positions.clear();
+        std::merge(
+            _backward.begin(),
+            _backward.end(),
+            _forward.begin(),
+            _forward.end(),
+            std::back_inserter(_positions),
+            by_order);
+
+        auto position = _positions.begin();
+        for (auto && node : _backward)
+        {
+            _ordering[node.node].order.store(position++->order, std::memory_order_relaxed);
+        }
+        for (auto && node : _forward)
+        {
+            _ordering[node.node].order.store(position++->order, std::memory_order_relaxed);
+        }
+
+        return true;
+    }
+
+    std::size_t _next_epoch()
+    {
+        return ++_epoch;
+    }
+
+    // Replaces the topological order with one for the graph plus the batch of edges, and returns which of
+    // them have to be left out. Tarjan's algorithm finds the strongly connected components, emitting each
+    // one after all the components it reaches. Since the graph itself is acyclic, a component of more than
+    // one node has to be closed by edges of the batch; within it, they are tried one by one, in order.
+    std::vector<bool> _order_with(std::span<const batch_edge> edges)
+    {
+        auto count = _node_slots();
+        std::vector<bool> rejected(edges.size());
+
+        // The batch's edges by source node, in compressed sparse row form.
+        std::vector<std::size_t> batch_offsets(count + 1);
+        for (std::size_t i = 0; i < edges.size(); ++i)
+        {
+            if (edges[i].from == edges[i].to)
+            {
+                rejected[i] = true;
+                continue;
+            }
+            ++batch_offsets[edges[i].from.id + 1];
+        }
+        std::partial_sum(batch_offsets.begin(), batch_offsets.end(), batch_offsets.begin());
+
+        std::vector<node_id> batch_targets(batch_offsets.back());
+        auto fill = batch_offsets;
+        for (std::size_t i = 0; i < edges.size(); ++i)
+        {
+            if (!rejected[i])
+            {
+                batch_targets[fill[edges[i].from.id]++] = edges[i].to;
+            }
+        }
+
+        // Iterative, since a graph of a million nodes could be a million nodes deep.
+        constexpr auto unvisited = std::numeric_limits<std::size_t>::max();
+        std::vector<std::size_t> index(count, unvisited);
+        std::vector<std::size_t> low(count);
+        std::vector<bool> on_stack(count);
+        std::vector<std::size_t> stack;
+
+        // Walks the node's own successors first, then those it gets from the batch.
+        struct frame
+        {
+            std::size_t node;
+            const adjacent_edge * next;
+            const adjacent_edge * end;
+            const node_id * next_batch;
+            const node_id * batch_end;
+        };
+        std::vector<frame> calls;
+
+        std::vector<std::size_t> component(count);
+        std::vector<std::size_t> component_nodes;
+        std::vector<std::size_t> component_offsets{ 0 };
+        std::size_t next_index = 0;
+
+        auto visit = [&](std::size_t v)
+        {
+            index[v] = low[v] = next_index++;
+            stack.push_back(v);
+            on_stack[v] = true;
+            auto & outgoing = _nodes[v].outgoing;
+            calls.push_back({ v,
+                              outgoing.data(),
+                              outgoing.data() + outgoing.size(),
+                              batch_targets.data() + batch_offsets[v],
+                              batch_targets.data() + batch_offsets[v + 1] });
+        };
+
+        for (std::size_t root = 0; root < count; ++root)
+        {
+            if (index[root] != unvisited)
+            {
+                continue;
+            }
+
+            visit(root);
+            while (!calls.empty())
+            {
+                auto & top = calls.back();
+                auto v = top.node;
+                if (top.next != top.end || top.next_batch != top.batch_end)
+                {
+                    auto w = top.next != top.end ? top.next++->node : top.next_batch++->id;
+                    if (index[w] == unvisited)
+                    {
+                        visit(w);
+                    }
+                    else if (on_stack[w])
+                    {
+                        low[v] = std::min(low[v], index[w]);
+                    }
+                    continue;
+                }
+
+                calls.pop_back();
+                if (!calls.empty())
+                {
+                    auto parent = calls.back().node;
+                    low[parent] = std::min(low[parent], low[v]);
+                }
+
+                if (low[v] == index[v])
+                {
+                    std::size_t w;
+                    do
+                    {
+                        w = stack.back();
+                        stack.pop_back();
+                        on_stack[w] = false;
+                        component[w] = component_offsets.size() - 1;
+                        component_nodes.push_back(w);
+                    } while (w != v);
+                    component_offsets.push_back(component_nodes.size());
+                }
+            }
+        }
+
+        // The batch's edges inside each cyclic component, in the order they were given.
+        std::unordered_map<std::size_t, std::vector<std::size_t>> cyclic;
+        for (std::size_t i = 0; i < edges.size(); ++i)
+        {
+            auto c = component[edges[i].from.id];
+            if (!rejected[i] && c == component[edges[i].to.id])
+            {
+                cyclic[c].push_back(i);
+            }
+        }
+
+        // Components were emitted after everything they reach, so the order goes through them backwards.
+        std::size_t position = 0;
+        std::vector<std::size_t> members;
+        for (auto c = component_offsets.size() - 1; c-- > 0;)
+        {
+            auto first = component_nodes.begin();
+            members.assign(first + component_offsets[c], first + component_offsets[c + 1]);
+            if (members.size() > 1)
+            {
+                _resolve_component(members, component, c, edges, cyclic[c], rejected);
+            }
+
+            for (auto && v : members)
+            {
+                _ordering[v].order.store(position++, std::memory_order_relaxed);
+            }
+        }
+        _next_order.store(position, std::memory_order_relaxed);
+
+        return rejected;
+    }
+
+    // Adds the batch's edges inside one component to the graph's own edges there one at a time, rejecting
+    // those that would close a cycle, then sorts the members topologically.
+    void _resolve_component(
+        std::vector<std::size_t> & members,
+        const std::vector<std::size_t> & component,
+        std::size_t c,
+        std::span<const batch_edge> edges,
+        const std::vector<std::size_t> & batch_edges,
+        std::vector<bool> & rejected)
+    {
+        std::unordered_map<std::size_t, std::size_t> local;
+        for (std::size_t i = 0; i < members.size(); ++i)
+        {
+            local.emplace(members[i], i);
+        }
+
+        std::vector<std::vector<std::size_t>> successors(members.size());
+        for (std::size_t i = 0; i < members.size(); ++i)
+        {
+            for (auto && adjacent : _nodes[members[i]].outgoing)
+            {
+                if (component[adjacent.node] == c)
+                {
+                    successors[i].push_back(local.at(adjacent.node));
+                }
+            }
+        }
+
+        std::vector<bool> visited;
+        std::vector<std::size_t> search;
+        auto reaches = [&](std::size_t from, std::size_t to)
+        {
+            visited.assign(members.size(), false);
+            search.assign({ from });
+            visited[from] = true;
+            while (!search.empty())
+            {
+                auto current = search.back();
+                search.pop_back();
+                if (current == to)
+                {
+                    return true;
+                }
+                for (auto && next : successors[current])
+                {
+                    if (!visited[next])
+                    {
+                        visited[next] = true;
+                        search.push_back(next);
+                    }
+                }
+            }
+            return false;
+        };
+
+        for (auto && i : batch_edges)
+        {
+            auto from = local.at(edges[i].from.id);
+            auto to = local.at(edges[i].to.id);
+            if (reaches(to, from))
+            {
+                rejected[i] = true;
+            }
+            else
+            {
+                successors[from].push_back(to);
+            }
+        }
+
+        std::vector<std::size_t> pending(members.size());
+        for (auto && list : successors)
+        {
+            for (auto && next : list)
+            {
+                ++pending[next];
+            }
+        }
+
+        std::vector<std::size_t> sorted;
+        for (std::size_t i = 0; i < members.size(); ++i)
+        {
+            if (!pending[i])
+            {
+                sorted.push_back(i);
+            }
+        }
+        for (std::size_t i = 0; i < sorted.size(); ++i)
+        {
+            for (auto && next : successors[sorted[i]])
+            {
+                if (!--pending[next])
+                {
+                    sorted.push_back(next);
+                }
+            }
+        }
+
+        for (auto && i : sorted)
+        {
+            i = members[i];
+        }
+        members = std::move(sorted);
+    }
+
+    // The nodes on some path starting at filter.to and ending at either filter.from or filter.to: everything
+    // reachable from filter.to that can also reach back to one of the two. Two linear searches, one along
+    // outgoing and one along incoming edges, instead of enumerating the paths themselves.
+    node_id_set _get_filtered_nodes(graph_filter_between filter) const
+    {
+        auto reachable = _reachable({ filter.to }, true);
+        auto reaching = _reachable({ filter.from, filter.to }, false);
+
+        node_id_set nodes_included{ filter.from, filter.to };
+        for (std::size_t i = 0; i < reachable.size(); ++i)
+        {
+            if (reachable[i] && reaching[i])
+            {
+                nodes_included.insert(_id_at(i));
+            }
+        }
+
+        return nodes_included;
+    }
+
+    std::vector<bool> _reachable(std::initializer_list<node_id> roots, bool forward) const
+    {
+        std::vector<bool> visited(_node_slots());
+        std::vector<std::size_t> stack;
+
+        for (auto && root : roots)
+        {
+            if (!visited[root.id])
+            {
+                visited[root.id] = true;
+                stack.push_back(root.id);
+            }
+        }
+
+        while (!stack.empty())
+        {
+            auto current = stack.back();
+            stack.pop_back();
+
+            for (auto && adjacent : forward ? _nodes[current].outgoing : _nodes[current].incoming)
+            {
+                auto next = adjacent.node;
+                if (!visited[next])
+                {
+                    visited[next] = true;
+                    stack.push_back(next);
+                }
+            }
+        }
+
+        return visited;
+    }
+
+    // Retired nodes are due to be reclaimed once they reach min_retired, and outnumber the live ones.
+    bool _reclaim_due() const
+    {
+        auto retired = _retired_count.load(std::memory_order_relaxed);
+        auto free = _free_nodes.size.load(std::memory_order_relaxed);
+        return retired >= _retention->min_retired && 2 * retired + free >= _node_slots();
+    }
+
+    // Removes the nodes flagged in removed, which removed_ids lists, and every edge touching them.
+    void _remove_nodes(const std::vector<bool> & removed, const std::vector<std::size_t> & removed_ids)
+    {
+        auto is_removed = [&](const adjacent_edge & adjacent) { return removed[adjacent.node]; };
+
+        // The remaining nodes each removed one reaches through removed ones only. Each set is found once, by
+        // a depth-first search that completes the successors of a node before the node itself, and merged
+        // from theirs. A node whose successors all lead to the same set, as along a chain, shares it; set 0
+        // is empty.
+        constexpr auto pending = std::numeric_limits<std::size_t>::max();
+        constexpr auto expanded = pending - 1;
+        std::vector<std::vector<std::size_t>> exit_sets(1);
+        std::vector<std::size_t> exits_of(removed.size(), pending);
+
+        // Nodes are marked with the epoch of the list being filled, so that none is added to it twice.
+        std::size_t epoch = 0;
+        auto add_exits = [&](std::vector<std::size_t> & into, const adjacent_edge & adjacent)
+        {
+            auto add = [&](std::size_t node)
+            {
+                if (_ordering[node].visited != epoch)
+                {
+                    _ordering[node].visited = epoch;
+                    into.push_back(node);
+                }
+            };
+
+            if (!is_removed(adjacent))
+            {
+                add(adjacent.node);
+                return;
+            }
+            for (auto node : exit_sets[exits_of[adjacent.node]])
+            {
+                add(node);
+            }
+        };
+
+        auto complete = [&](std::size_t i)
+        {
+            auto & outgoing = _nodes[i].outgoing;
+            auto shared = outgoing.empty() ? 0 : exits_of[outgoing.front().node];
+            bool same = std::all_of(
+                outgoing.begin(),
+                outgoing.end(),
+                [&](const adjacent_edge & adjacent)
+                { return is_removed(adjacent) && exits_of[adjacent.node] == shared; });
+            if (same)
+            {
+                exits_of[i] = shared;
+                return;
+            }
+
+            epoch = _next_epoch();
+            std::vector<std::size_t> exits;
+            for (auto && adjacent : outgoing)
+            {
+                add_exits(exits, adjacent);
+            }
+            exits_of[i] = exit_sets.size();
+            exit_sets.push_back(std::move(exits));
+        };
+
+        // The graph has no cycles, so a successor of an expanded node is never expanded itself, only pending
+        // or complete.
+        auto find_exits = [&](std::size_t root)
+        {
+            _search_stack.assign({ root });
+            while (!_search_stack.empty())
+            {
+                auto current = _search_stack.back();
+                if (exits_of[current] == pending)
+                {
+                    exits_of[current] = expanded;
+                    for (auto && adjacent : _nodes[current].outgoing)
+                    {
+                        if (is_removed(adjacent) && exits_of[adjacent.node] == pending)
+                        {
+                            _search_stack.push_back(adjacent.node);
+                        }
+                    }
+                    continue;
+                }
+
+                _search_stack.pop_back();
+                if (exits_of[current] == expanded)
+                {
+                    complete(current);
+                }
+            }
+        };
+
+        // Remaining nodes next to removed ones, and for those with removed successors, summary edges to where
+        // those lead. Nodes that are already successors do not need one.
+        std::vector<std::size_t> neighbours;
+        std::vector<std::pair<node_id, node_id>> summaries;
+        std::vector<std::size_t> targets;
+        for (std::size_t i = 0; i < removed.size(); ++i)
+        {
+            auto & node = _nodes[i];
+            if (removed[i] || node.free)
+            {
+                continue;
+            }
+
+            bool before = std::any_of(node.outgoing.begin(), node.outgoing.end(), is_removed);
+            if (!before && std::none_of(node.incoming.begin(), node.incoming.end(), is_removed))
+            {
+                continue;
+            }
+            neighbours.push_back(i);
+            if (!before)
+            {
+                continue;
+            }
+
+            for (auto && adjacent : node.outgoing)
+            {
+                if (is_removed(adjacent))
+                {
+                    find_exits(adjacent.node);
+                }
+            }
+
+            epoch = _next_epoch();
+            for (auto && adjacent : node.outgoing)
+            {
+                _ordering[adjacent.node].visited = epoch;
+            }
+
+            targets.clear();
+            for (auto && adjacent : node.outgoing)
+            {
+                if (is_removed(adjacent))
+                {
+                    add_exits(targets, adjacent);
+                }
+            }
+            for (auto next : targets)
+            {
+                summaries.emplace_back(_id_at(i), _id_at(next));
+            }
+        }
+
+        // Every edge is freed once: through its source's outgoing list, whether or not the source is removed.
+        for (auto i : neighbours)
+        {
+            auto & node = _nodes[i];
+            for (auto && adjacent : node.outgoing)
+            {
+                if (is_removed(adjacent))
+                {
+                    _free_edge(adjacent.edge);
+                }
+            }
+            std::erase_if(node.outgoing, is_removed);
+            std::erase_if(node.incoming, is_removed);
+        }
+
+        for (auto i : removed_ids)
+        {
+            auto & node = _nodes[i];
+            for (auto && adjacent : node.outgoing)
+            {
+                _free_edge(adjacent.edge);
+            }
+            node.outgoing = {};
+            node.incoming = {};
+            ++node.generation;
+            node.free = true;
+            node.retired.store(false, std::memory_order_relaxed);
+            _node_details[i] = {};
+            _free_nodes.put(i);
+        }
+
+        for (std::size_t i = 0; i < _cluster_count.load(std::memory_order_acquire); ++i)
+        {
+            std::erase_if(_clusters[i].child_nodes, [&](node_id id) { return removed[id.id]; });
+        }
+
+        // A path between two remaining nodes goes forward in the order, so their summary edges agree with it.
+        for (auto && [from, to] : summaries)
+        {
+            _insert_edge(from, to, edge_type::summary, {}, {});
+        }
+    }
+
+    void _free_edge(std::size_t index)
+    {
+        if (_edge_index)
+        {
+            auto & edge = _edges[index];
+            edge_key key{ edge.from, edge.to, edge.type, edge.label, edge.loc };
+            _edge_index[edge_key_hash{}(key) % _edge_index_shard_count].edges.erase(key);
+        }
+        _free_edges.put(index);
+    }
+
+    // Removes retired clusters that have neither nodes nor child clusters, which can leave their parents
+    // empty in turn.
+    void _remove_clusters()
+    {
+        for (bool removed_any = true; removed_any;)
+        {
+            removed_any = false;
+            for (std::size_t i = 0; i < _cluster_count.load(std::memory_order_acquire); ++i)
+            {
+                auto & cluster = _clusters[i];
+                if (cluster.free || !cluster.retired.load(std::memory_order_relaxed)
+                    || !cluster.child_nodes.empty() || !cluster.child_clusters.empty())
+                {
+                    continue;
+                }
+
+                if (cluster.parent)
+                {
+                    std::erase_if(
+                        _clusters[cluster.parent->id].child_clusters,
+                        [&](cluster_id child) { return child.id == i; });
+                }
+
+                ++cluster.id.generation;
+                cluster.name = 0;
+                cluster.description = 0;
+                cluster.loc = {};
+                cluster.child_clusters = {};
+                cluster.child_nodes = {};
+                cluster.parent.reset();
+                cluster.free = true;
+                cluster.retired.store(false, std::memory_order_relaxed);
+                _free_clusters.put(i);
+                removed_any = true;
+            }
+        }
+    }
+
+    cluster_id _add_cluster(std::string_view name, std::string_view description, source_location loc)
+    {
+        std::size_t id;
+        if (auto slot = _free_clusters.take())
+        {
+            id = *slot;
+            _clusters[id].free = false;
+        }
+        else
+        {
+            id = _cluster_count.fetch_add(1, std::memory_order_acq_rel);
+            _clusters.ensure(id).id = { id };
+        }
+
+        auto & cluster = _clusters[id];
+        cluster.name = _strings.intern(name);
+        cluster.description = _strings.intern(description);
+        cluster.loc = loc;
+        return cluster.id;
+    }
+
+    node_id _add_node(
+        std::string_view name,
+        std::string_view description,
+        source_location loc,
+        node_kind kind)
+    {
+        std::size_t id;
+        if (auto slot = _free_nodes.take())
+        {
+            // The slot keeps its position in the order, which it is free to take since it has no edges.
+            id = *slot;
+            _nodes[id].free = false;
+        }
+        else
+        {
+            id = _node_slot_count.fetch_add(1, std::memory_order_acq_rel);
+            _nodes.ensure(id);
+            auto order = _next_order.fetch_add(1, std::memory_order_relaxed);
+            _ordering.ensure(id).order.store(order, std::memory_order_relaxed);
+        }
+
+        auto & details = _node_details.ensure(id);
+        details.name = _strings.intern(name);
+        details.description = _strings.intern(description);
+        details.loc = loc;
+        details.kind = kind;
+        return _id_at(id);
+    }
+
+    // With check_order, the edge is only added if it still agrees with the order once `from` is locked, and
+    // false returned otherwise.
+    bool _insert_edge(
+        node_id from,
+        node_id to,
+        edge_type type,
+        std::string_view label,
+        source_location loc,
+        std::optional<edge_statistics> statistics = std::nullopt,
+        bool check_order = false)
+    {
+        auto label_id = _strings.intern(label);
+        if (!statistics)
+        {
+            auto now = _edge_index ? _relative_now() : 0;
+            statistics = edge_statistics{ 1, now, now };
+        }
+
+        // When merging, the edge's shard stays locked until the edge is complete, so that another thread
+        // adding the same edge either finds it whole or adds it first.
+        std::unique_lock<std::mutex> index_lock;
+        edge_index_shard * shard = nullptr;
+        std::unordered_map<edge_key, std::size_t, edge_key_hash>::iterator indexed;
+        if (_edge_index)
+        {
+            edge_key key{ from, to, type, label_id, loc };
+            shard = &_edge_index[edge_key_hash{}(key) % _edge_index_shard_count];
+            index_lock = std::unique_lock<std::mutex>{ shard->mutex };
+
+            auto [it, inserted] = shard->edges.try_emplace(key, 0);
+            if (!inserted)
+            {
+                auto & existing = _edges[it->second].statistics;
+                existing.hits += statistics->hits;
+                existing.first_seen = std::min(existing.first_seen, statistics->first_seen);
+                existing.last_seen = std::max(existing.last_seen, statistics->last_seen);
+                return true;
+            }
+            indexed = it;
+        }
+
+        std::size_t index;
+        {
+            std::lock_guard<detail::spin_lock> lock{ _nodes[from.id].lock };
+            if (check_order && _order_of(from.id) >= _order_of(to.id))
+            {
+                if (shard)
+                {
+                    shard->edges.erase(indexed);
+                }
+                return false;
+            }
+
+            auto slot = _free_edges.take();
+            index = slot ? *slot : _edge_slot_count.fetch_add(1, std::memory_order_acq_rel);
+            _edges.ensure(index) = edge{ from, to, type, label_id, loc, *statistics };
+            if (shard)
+            {
+                indexed->second = index;
+            }
+            _nodes[from.id].outgoing.push_back({ to.id, index });
+        }
+
+        std::lock_guard<detail::spin_lock> lock{ _nodes[to.id].lock };
+        _nodes[to.id].incoming.push_back({ from.id, index });
+        return true;
+    }
+
+    // Slots ever allocated, including those of reclaimed elements; ids are below them.
+    std::size_t _node_slots() const
+    {
+        return _node_slot_count.load(std::memory_order_acquire);
+    }
+
+    std::size_t _edge_slots() const
+    {
+        return _edge_slot_count.load(std::memory_order_acquire);
+    }
+
+    void _check_node(node_id id) const
+    {
+        if (id.id >= _node_slots())
+        {
+            throw std::out_of_range("guilt::dependency_graph: invalid node id");
+        }
+    }
+
+    // Whether the id's generation is the one its slot is at; the id has to pass _check_node.
+    bool _is_current(node_id id) const
+    {
+        return _nodes[id.id].generation == id.generation;
+    }
+
+    void _check_current(node_id id) const
+    {
+        _check_node(id);
+        if (!_is_current(id))
+        {
+            throw std::out_of_range("guilt::dependency_graph: the node was reclaimed");
+        }
+    }
+
+    node_id _id_at(std::size_t index) const
+    {
+        return node_id{ index, _nodes[index].generation };
+    }
+
+    std::size_t _order_of(std::size_t index) const
+    {
+        return _ordering[index].order.load(std::memory_order_relaxed);
+    }
+
+    const cluster & _cluster_at(cluster_id id) const
+    {
+        if (id.id >= _cluster_count.load(std::memory_order_acquire))
+        {
+            throw std::out_of_range("guilt::dependency_graph: invalid cluster id");
+        }
+        auto & ret = _clusters[id.id];
+        if (ret.id.generation != id.generation)
+        {
+            throw std::out_of_range("guilt::dependency_graph: the cluster was reclaimed");
+        }
+        return ret;
+    }
+
+    cluster & _cluster_at(cluster_id id)
+    {
+        return const_cast<cluster &>(std::as_const(*this)._cluster_at(id));
+    }
+
+    // A neighbour of a node, and the index into _edges of the edge connecting them. Edges of reclaimed nodes
+    // are removed along with them, so neighbours are always at their slot's current generation.
+    struct adjacent_edge
+    {
+        std::size_t node;
+        std::size_t edge;
+    };
+
+    // Nodes are stored as parallel arrays indexed by id: node and node_ordering hold what graph algorithms
+    // look at, and node_details what only exports do, so that searches do not pull names and locations into
+    // the cache. Edges are only read by exports; searches find everything they need in the adjacency lists.
+    struct node
+    {
+        // Edges can be added to a node by multiple threads at once, under lock.
+        std::vector<adjacent_edge> outgoing;
+        std::vector<adjacent_edge> incoming;
+        detail::spin_lock lock;
+
+        // Only changed under the exclusive lock, when the node is reclaimed.
+        std::uint32_t generation = 0;
+        // Set for slots of reclaimed nodes until they are taken again; only read under the exclusive lock.
+        bool free = false;
+        std::atomic<bool> retired = false;
+    };
+
+    // What the searches of _update_order check for every node they come across, kept dense on its own.
+    struct node_ordering
+    {
+        // Past the node's creation, only rearranged under the exclusive lock, or raised by _move_to_end with
+        // the node locked.
+        std::atomic<std::size_t> order = 0;
+        std::size_t visited = 0;
+    };
+
+    struct ordered_node
+    {
+        std::size_t order;
+        std::size_t node;
+    };
+
+    // Names, descriptions, and labels are indices into _strings.
+    struct node_details
+    {
+        std::size_t name = 0;
+        std::size_t description = 0;
+        source_location loc;
+        node_kind kind = node_kind::plain;
+    };
+
+    struct edge
+    {
+        node_id from;
+        node_id to;
+        edge_type type;
+        std::size_t label = 0;
+        source_location loc;
+        edge_statistics statistics;
+    };
+
+    // Identifies duplicate edges. Source locations compare by file name contents, since the same file can be
+    // named by different pointers in different translation units.
+    struct edge_key
+    {
+        node_id from;
         node_id to;
         edge_type type;
-        std::string label;
+        std::size_t label;
+        source_location loc;
+
+        bool operator==(const edge_key & other) const
+        {
+            auto same_file = loc.file_name == other.loc.file_name
+                || (loc.file_name && other.loc.file_name && !std::strcmp(loc.file_name, other.loc.file_name));
+            return from == other.from && to == other.to && type == other.type && label == other.label
+                && loc.line == other.loc.line && same_file;
+        }
+    };
+
+    struct edge_key_hash
+    {
+        std::size_t operator()(const edge_key & key) const
+        {
+            auto hash = key.from.id * 0x9e3779b97f4a7c15 ^ key.to.id;
+            hash = hash * 0x9e3779b97f4a7c15 ^ (key.label << 8 | static_cast<std::size_t>(key.type));
+            return hash * 0x9e3779b97f4a7c15 ^ key.loc.line;
+        }
+    };
 
-        auto operator<=>(const edge &) const = default;
+    struct alignas(64) edge_index_shard
+    {
+        std::mutex mutex;
+        std::unordered_map<edge_key, std::size_t, edge_key_hash> edges;
     };
 
+    static std::uint64_t _now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    std::uint64_t _relative_now() const
+    {
+        return _now() - _created;
+    }
+
     struct cluster
     {
         cluster_id id;
-        std::string name;
-        std::string description;
+        std::size_t name = 0;
+        std::size_t description = 0;
+        source_location loc;
 
         std::vector<cluster_id> child_clusters = {};
         std::vector<node_id> child_nodes = {};
         std::optional<cluster_id> parent = {};
+        detail::spin_lock lock;
+
+        bool free = false;
+        std::atomic<bool> retired = false;
     };
 
-    std::vector<node> _nodes;
-    std::vector<edge> _edges;
-    std::vector<cluster> _clusters;
-};
+    struct cluster_copy
+    {
+        cluster_id id;
+        std::size_t name;
+        std::size_t description;
+        source_location loc;
+        std::vector<cluster_id> child_clusters;
+        std::vector<node_id> child_nodes;
+        // Not reclaimed, and without a parent.
+        bool top_level;
+    };
 
-inline std::string dependency_cycle::to_graphviz() const
-{
-    std::string ret;
+    // What an export reads of the graph, apart from strings, which _strings hands out without a lock.
+    struct export_copy
+    {
+        // The nodes that have not been reclaimed, and their details.
+        std::vector<node_id> nodes;
+        std::vector<node_details> details;
+        // Every cluster slot, by id.
+        std::vector<cluster_copy> clusters;
+        // Grouped by their source node, in the order they were added.
+        std::vector<edge> edges;
+    };
+
+    // Slots of reclaimed elements, taken again before new ones are allocated. They are only put back under
+    // the exclusive lock; size lets take() skip the spin lock while there is nothing to take.
+    struct free_slots
+    {
+        detail::spin_lock lock;
+        std::vector<std::size_t> slots;
+        std::atomic<std::size_t> size = 0;
+
+        std::optional<std::size_t> take()
+        {
+            if (!size.load(std::memory_order_relaxed))
+            {
+                return std::nullopt;
+            }
 
-    ret += _graph->_graphviz_header();
+            std::lock_guard<detail::spin_lock> guard{ lock };
+            if (slots.empty())
+            {
+                return std::nullopt;
+            }
+            auto ret = slots.back();
+            slots.pop_back();
+            size.store(slots.size(), std::memory_order_relaxed);
+            return ret;
+        }
 
-    ret += "    node_" + std::to_string(_to.id) + " -> node_" + std::to_string(_from.id)
-        + " [ style = \"dashed\" color = \"red\" fontcolor = \"red\" constraint = \"false\" label = \""
-        + _label + "\" ];\n";
-    ret += _graph->_generate_graphviz(
-        _graph->_get_filtered_nodes(dependency_graph::graph_filter_between{ _from, _to }));
+        void put(std::size_t slot)
+        {
+            slots.push_back(slot);
+            size.store(slots.size(), std::memory_order_relaxed);
+        }
+    };
 
-    ret += _graph->_graphviz_footer();
+    mutable detail::sharded_shared_mutex _mutex;
+    detail::string_table _strings;
+
+    static constexpr std::size_t _edge_index_shard_count = 16;
+
+    std::uint64_t _created = _now();
+    // Only allocated when merging duplicate edges: the edges added so far, by edge_key.
+    std::unique_ptr<edge_index_shard[]> _edge_index;
+
+    // Ids are handed out before the elements are filled in; everything below a count is complete by the time
+    // the exclusive lock is acquired.
+    std::atomic<std::size_t> _node_slot_count = 0;
+    std::atomic<std::size_t> _edge_slot_count = 0;
+    std::atomic<std::size_t> _cluster_count = 0;
+    // Greater than every position in the order; new positions are taken from here.
+    std::atomic<std::size_t> _next_order = 0;
+
+    std::optional<retention_policy> _retention;
+    // Retired nodes that have not been reclaimed yet.
+    std::atomic<std::size_t> _retired_count = 0;
+    std::atomic<bool> _reclaiming = false;
+    free_slots _free_nodes;
+    free_slots _free_edges;
+    free_slots _free_clusters;
+
+    detail::segmented_vector<node> _nodes;
+    detail::segmented_vector<node_ordering> _ordering;
+    detail::segmented_vector<node_details> _node_details;
+    detail::segmented_vector<edge> _edges;
+    detail::segmented_vector<cluster> _clusters;
+
+    // Scratch space for _update_order, kept around to avoid allocating on every edge. A node has been visited
+    // by the current search if its visited entry equals _epoch.
+    std::size_t _epoch = 0;
+    std::vector<std::size_t> _search_stack;
+    std::vector<ordered_node> _forward;
+    std::vector<ordered_node> _backward;
+    std::vector<ordered_node> _positions;
+};
 
+inline std::string dependency_cycle::to_graphviz() const
+{
+    std::string ret;
+    write_graphviz(std::back_inserter(ret));
     return ret;
 }
 
 inline std::string dependency_cycle::full_graph_graphviz() const
 {
     std::string ret;
+    write_full_graph_graphviz(std::back_inserter(ret));
+    return ret;
+}
+
+template<std::output_iterator<char> OutputIt>
+OutputIt dependency_cycle::write_graphviz(OutputIt out) const
+{
+    std::unique_lock<detail::sharded_shared_mutex> lock{ _graph->_mutex };
+    auto copy = _graph->_copy_for_export();
+    auto filtered_node_ids = _graph->_get_filtered_nodes({ _from, _to });
+    lock.unlock();
+
+    detail::graphviz_writer<OutputIt> writer{ out };
+    writer << dependency_graph::_graphviz_header;
+    _write_cycle_edge(writer);
+    _graph->_write_graphviz(writer, copy, dependency_graph::_contained_in(filtered_node_ids));
+    writer << dependency_graph::_graphviz_footer;
+    return writer.out();
+}
 
-    ret += _graph->_graphviz_header();
+template<std::output_iterator<char> OutputIt>
+OutputIt dependency_cycle::write_full_graph_graphviz(OutputIt out) const
+{
+    std::unique_lock<detail::sharded_shared_mutex> lock{ _graph->_mutex };
+    auto copy = _graph->_copy_for_export();
+    lock.unlock();
+
+    detail::graphviz_writer<OutputIt> writer{ out };
+    writer << dependency_graph::_graphviz_header;
+    _write_cycle_edge(writer);
+    _graph->_write_graphviz(writer, copy, [](node_id) { return true; });
+    writer << dependency_graph::_graphviz_footer;
+    return writer.out();
+}
 
-    ret += "    node_" + std::to_string(_to.id) + " -> node_" + std::to_string(_from.id)
-        + " [ style = \"dashed\" color = \"red\" fontcolor = \"red\" constraint = \"false\" label = \""
-        + _label + "\" ];\n";
-    ret += _graph->_generate_graphviz();
+inline void dependency_cycle::write_graphviz(std::ostream & os) const
+{
+    write_graphviz(std::ostreambuf_iterator<char>{ os });
+}
 
-    ret += _graph->_graphviz_footer();
+inline void dependency_cycle::write_full_graph_graphviz(std::ostream & os) const
+{
+    write_full_graph_graphviz(std::ostreambuf_iterator<char>{ os });
+}
 
-    return ret;
+template<typename Writer>
+void dependency_cycle::_write_cycle_edge(Writer & writer) const
+{
+    writer << "    node_" << _to.id << " -> node_" << _from.id
+           << " [ style = \"dashed\" color = \"red\" fontcolor = \"red\" constraint = \"false\" label = \""
+           << _label << "\" ];\n";
 }
 }
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <bit>
+#include <cassert>
+#include <cstddef>
+
+#include "tasking.h"
+
+namespace guilt
+{
+// A single threaded context that runs the highest priority job it has, and jobs of the same priority in the
+// order they were queued. Every priority has a queue of its own, with a bit mask of the non-empty ones, so
+// when everything runs at a single priority this costs about the same as the plain execution_context.
+class priority_execution_context : public execution_context
+{
+protected:
+    void _enqueue(Callback cb, task_priority priority) override
+    {
+        if (_is_running_here())
+        {
+            _push(job{ nullptr, std::move(cb), priority });
+            return;
+        }
+
+        _inject(job{ nullptr, std::move(cb), priority });
+    }
+
+    void _enqueue(coro::coroutine_handle<> h, task_priority priority) override
+    {
+        if (_is_running_here())
+        {
+            auto level = _level(priority);
+            _levels[level].push_back(h, priority);
+            _non_empty |= 1u << level;
+            return;
+        }
+
+        _inject(job{ h, {}, priority });
+    }
+
+    bool _handle_one() override
+    {
+        _take_injected([&](job j) { _push(std::move(j)); });
+
+        if (!_non_empty)
+        {
+            return false;
+        }
+
+        auto level = std::bit_width(_non_empty) - 1;
+        auto next = _levels[level].pop_front();
+        if (_levels[level].empty())
+        {
+            _non_empty &= ~(1u << level);
+        }
+
+        _run(next);
+        return true;
+    }
+
+private:
+    static std::size_t _level(task_priority priority)
+    {
+        auto level = static_cast<std::size_t>(priority);
+        assert(level < task_priority_levels);
+        return level;
+    }
+
+    void _push(job j)
+    {
+        auto level = _level(j.priority);
+        _levels[level].push_back(std::move(j));
+        _non_empty |= 1u << level;
+    }
+
+    ready_queue _levels[task_priority_levels];
+    unsigned _non_empty = 0;
+};
+}
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "graph.h"
+
+namespace guilt
+{
+enum class trace_event_kind : std::uint8_t
+{
+    region_begin,
+    region_end,
+    suspend,
+    resume
+};
+
+struct trace_event
+{
+    std::uint64_t timestamp;
+    trace_event_kind kind;
+    cluster_id function;
+    // The begin node of the region the event belongs to.
+    node_id node;
+};
+
+class profiler;
+
+namespace detail
+{
+    // Events recorded by a single thread. Only the owning thread writes; once the buffer is full, the oldest
+    // events are overwritten.
+    class trace_buffer
+    {
+    public:
+        trace_buffer(std::thread::id thread, std::size_t thread_index, std::size_t capacity)
+            : _thread{ thread }, _thread_index{ thread_index }, _events(capacity)
+        {
+        }
+
+        void record(const trace_event & event)
+        {
+            auto written = _written.load(std::memory_order_relaxed);
+            _events[written % _events.size()] = event;
+            _written.store(written + 1, std::memory_order_release);
+        }
+
+        std::thread::id thread() const
+        {
+            return _thread;
+        }
+
+        std::size_t thread_index() const
+        {
+            return _thread_index;
+        }
+
+        template<typename F>
+        void for_each(F && f) const
+        {
+            auto written = _written.load(std::memory_order_acquire);
+            auto first = written > _events.size() ? written - _events.size() : 0;
+            for (auto i = first; i < written; ++i)
+            {
+                f(_events[i % _events.size()]);
+            }
+        }
+
+    private:
+        std::thread::id _thread;
+        std::size_t _thread_index;
+        std::vector<trace_event> _events;
+        std::atomic<std::size_t> _written = 0;
+    };
+
+    struct trace_buffer_binding
+    {
+        std::uint64_t profiler_serial = 0;
+        trace_buffer * buffer = nullptr;
+    };
+
+    inline thread_local trace_buffer_binding this_thread_trace_buffer;
+
+    inline std::atomic<profiler *> & active_profiler_pointer()
+    {
+        static std::atomic<profiler *> instance = nullptr;
+        return instance;
+    }
+
+    inline std::uint64_t next_profiler_serial()
+    {
+        static std::atomic<std::uint64_t> serial = 0;
+        return ++serial;
+    }
+
+    inline void write_json_string(std::ostream & os, std::string_view str)
+    {
+        os << '"';
+        for (auto c : str)
+        {
+            switch (c)
+            {
+                case '"':
+                    os << "\\\"";
+                    break;
+                case '\\':
+                    os << "\\\\";
+                    break;
+                case '\n':
+                    os << "\\n";
+                    break;
+                case '\t':
+                    os << "\\t";
+                    break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20)
+                    {
+                        os << ' ';
+                    }
+                    else
+                    {
+                        os << c;
+                    }
+            }
+        }
+        os << '"';
+    }
+
+    // Trace event timestamps are in microseconds; keeps the nanoseconds as three decimal places.
+    inline void write_microseconds(std::ostream & os, std::uint64_t nanoseconds)
+    {
+        auto fraction = nanoseconds % 1000;
+        os << nanoseconds / 1000 << '.' << fraction / 100 << fraction / 10 % 10 << fraction % 10;
+    }
+}
+
+// Collects timestamped region and suspension events from annotated tasks while it is the active profiler.
+// Every thread records into a ring buffer of its own, so recording neither locks nor allocates after the
+// first event of a thread. Exporting reads those buffers, and should happen once the profiled tasks have
+// finished.
+class profiler
+{
+public:
+    static constexpr std::size_t default_events_per_thread = 1 << 16;
+
+    explicit profiler(std::size_t events_per_thread = default_events_per_thread)
+        : _events_per_thread{ std::max<std::size_t>(events_per_thread, 1) },
+          _serial{ detail::next_profiler_serial() },
+          _start{ _now() }
+    {
+    }
+
+    profiler(const profiler &) = delete;
+    profiler & operator=(const profiler &) = delete;
+
+    ~profiler()
+    {
+        auto self = this;
+        detail::active_profiler_pointer().compare_exchange_strong(self, nullptr);
+    }
+
+    void record(trace_event_kind kind, cluster_id function, node_id node)
+    {
+        _buffer().record(trace_event{ _now() - _start, kind, function, node });
+    }
+
+    // Calls f(thread_index, event) for every event still held by the buffers, thread by thread, in the order
+    // each thread recorded them. Timestamps are in nanoseconds since the profiler was created.
+    template<typename F>
+    void for_each_event(F && f) const
+    {
+        std::lock_guard<std::mutex> lock{ _buffers_mutex };
+        for (auto && buffer : _buffers)
+        {
+            buffer->for_each([&](const trace_event & event) { f(buffer->thread_index(), event); });
+        }
+    }
+
+    // Writes the events in the Chrome trace event format, which Perfetto also reads. Regions become async
+    // slices named and identified by their begin node, with the time they spent suspended on a track of the
+    // same id. Regions and functions the graph has reclaimed since are named "(reclaimed)".
+    void write_chrome_trace(std::ostream & os, const dependency_graph & graph) const
+    {
+        os << "{ \"traceEvents\": [";
+
+        bool first = true;
+        for_each_event(
+            [&](std::size_t thread_index, const trace_event & event)
+            {
+                auto kind = event.kind;
+                bool begin = kind == trace_event_kind::region_begin || kind == trace_event_kind::suspend;
+                bool region = kind == trace_event_kind::region_begin || kind == trace_event_kind::region_end;
+
+                os << (first ? "\n" : ",\n") << "    { \"name\": ";
+                auto name = !region ? "suspended"
+                    : graph.contains(event.node) ? graph.node_name(event.node)
+                                                 : "(reclaimed)";
+                detail::write_json_string(os, name);
+                os << ", \"cat\": \"" << (region ? "region" : "suspension") << "\", \"ph\": \""
+                   << (begin ? 'b' : 'e') << "\", \"id\": " << event.node.id << ", \"ts\": ";
+                detail::write_microseconds(os, event.timestamp);
+                os << ", \"pid\": 0, \"tid\": " << thread_index << ", \"args\": { \"function\": ";
+                detail::write_json_string(
+                    os, graph.contains(event.function) ? graph.cluster_name(event.function) : "(reclaimed)");
+                os << ", \"cluster\": " << event.function.id << ", \"node\": " << event.node.id << " } }";
+
+                first = false;
+            });
+
+        os << "\n] }\n";
+    }
+
+    std::string to_chrome_trace(const dependency_graph & graph) const
+    {
+        std::ostringstream os;
+        write_chrome_trace(os, graph);
+        return os.str();
+    }
+
+private:
+    static std::uint64_t _now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    detail::trace_buffer & _buffer()
+    {
+        auto & binding = detail::this_thread_trace_buffer;
+        if (binding.profiler_serial == _serial)
+        {
+            return *binding.buffer;
+        }
+
+        // The thread was last recording into another profiler, or has not recorded anything yet.
+        std::lock_guard<std::mutex> lock{ _buffers_mutex };
+        auto thread = std::this_thread::get_id();
+        auto it = std::find_if(
+            _buffers.begin(), _buffers.end(), [&](auto && buffer) { return buffer->thread() == thread; });
+        if (it == _buffers.end())
+        {
+            _buffers.push_back(
+                std::make_unique<detail::trace_buffer>(thread, _buffers.size(), _events_per_thread));
+            it = std::prev(_buffers.end());
+        }
+
+        binding = { _serial, it->get() };
+        return *binding.buffer;
+    }
+
+    std::size_t _events_per_thread;
+    std::uint64_t _serial;
+    std::uint64_t _start;
+
+    mutable std::mutex _buffers_mutex;
+    std::vector<std::unique_ptr<detail::trace_buffer>> _buffers;
+};
+
+inline profiler * active_profiler()
+{
+    return detail::active_profiler_pointer().load(std::memory_order_acquire);
+}
+
+// Makes annotated tasks record into p, or stops recording if p is null. Returns the previously active
+// profiler.
+inline profiler * set_active_profiler(profiler * p)
+{
+    return detail::active_profiler_pointer().exchange(p, std::memory_order_acq_rel);
+}
+
+namespace detail
+{
+    inline void record_trace_event(trace_event_kind kind, cluster_id function, node_id node)
+    {
+        if (auto p = active_profiler())
+        {
+            p->record(kind, function, node);
+        }
+    }
+}
+}
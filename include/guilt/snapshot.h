@@ -0,0 +1,571 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "graph.h"
+
+namespace guilt
+{
+// The binary layout of a graph snapshot, in the byte order of the machine that wrote it:
+//
+//     snapshot_header
+//     std::uint64_t string_offsets[string_count + 1]
+//     snapshot_cluster clusters[cluster_count]
+//     snapshot_node nodes[node_count]
+//     snapshot_edge edges[edge_count]
+//     char string_bytes[string_bytes]
+//
+// String i occupies string_bytes[string_offsets[i], string_offsets[i + 1]) and is followed by a '\0' that is
+// included in the range; string 0 is the empty string. Every section is aligned to 8 bytes, so a snapshot
+// can be used in place, e.g. after mapping a file into memory. Ids are indices into the cluster and node
+// arrays, which keep the slots of reclaimed elements; edges only include those still in the graph.
+namespace snapshot_format
+{
+    constexpr char magic[8] = { 'G', 'U', 'I', 'L', 'T', 'S', 'N', 'P' };
+    constexpr std::uint32_t version = 2;
+    constexpr std::uint32_t byte_order = 0x01020304;
+    constexpr std::uint64_t none = std::numeric_limits<std::uint64_t>::max();
+
+    // Flags of clusters and nodes.
+    constexpr std::uint8_t reclaimed = 1;
+    constexpr std::uint8_t retired = 2;
+}
+
+struct snapshot_header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t string_count;
+    std::uint64_t string_bytes;
+    std::uint64_t cluster_count;
+    std::uint64_t node_count;
+    std::uint64_t edge_count;
+};
+
+// Strings are string indices, with 0 for none; a file of 0 means there is no source location.
+struct snapshot_cluster
+{
+    std::uint64_t name;
+    std::uint64_t description;
+    std::uint64_t file;
+    std::uint64_t parent;
+    std::uint32_t line;
+    std::uint32_t generation;
+    std::uint8_t flags;
+    std::uint8_t reserved[7];
+};
+
+struct snapshot_node
+{
+    std::uint64_t name;
+    std::uint64_t description;
+    std::uint64_t file;
+    std::uint64_t cluster;
+    // The node's position in the graph's topological order.
+    std::uint64_t order;
+    std::uint32_t line;
+    std::uint32_t generation;
+    std::uint8_t kind;
+    std::uint8_t flags;
+    std::uint8_t reserved[6];
+};
+
+struct snapshot_edge
+{
+    std::uint64_t from;
+    std::uint64_t to;
+    std::uint64_t label;
+    std::uint64_t file;
+    std::uint64_t hits;
+    std::uint64_t first_seen;
+    std::uint64_t last_seen;
+    std::uint32_t line;
+    std::uint8_t type;
+    std::uint8_t reserved[3];
+};
+
+static_assert(sizeof(snapshot_header) == 56 && sizeof(snapshot_cluster) == 48 && sizeof(snapshot_node) == 56
+              && sizeof(snapshot_edge) == 64);
+
+// A read-only view of a snapshot held in memory that the caller owns. The constructor checks the header and
+// the string table; the records are only checked when they are loaded into a graph.
+class graph_snapshot
+{
+public:
+    explicit graph_snapshot(std::span<const std::byte> bytes) : _bytes{ bytes }
+    {
+        if (reinterpret_cast<std::uintptr_t>(bytes.data()) % alignof(std::uint64_t))
+        {
+            _fail("the snapshot is not aligned to 8 bytes");
+        }
+        if (bytes.size() < sizeof(snapshot_header))
+        {
+            _fail("the snapshot is truncated");
+        }
+
+        auto & header = this->header();
+        if (std::memcmp(header.magic, snapshot_format::magic, sizeof(header.magic)))
+        {
+            _fail("not a graph snapshot");
+        }
+        if (header.byte_order != snapshot_format::byte_order)
+        {
+            _fail("the snapshot was written with a different byte order");
+        }
+        if (header.version != snapshot_format::version)
+        {
+            _fail("unsupported snapshot version");
+        }
+
+        std::size_t size = sizeof(snapshot_header);
+        auto take = [&](std::uint64_t count, std::size_t element_size)
+        {
+            auto offset = size;
+            if (count > (bytes.size() - size) / element_size)
+            {
+                _fail("the snapshot is truncated");
+            }
+            size += count * element_size;
+            return offset;
+        };
+
+        if (header.string_count == 0 || header.string_count == snapshot_format::none)
+        {
+            _fail("the string table is malformed");
+        }
+        _string_offsets = take(header.string_count + 1, sizeof(std::uint64_t));
+        _clusters = take(header.cluster_count, sizeof(snapshot_cluster));
+        _nodes = take(header.node_count, sizeof(snapshot_node));
+        _edges = take(header.edge_count, sizeof(snapshot_edge));
+        _string_bytes = take(header.string_bytes, 1);
+
+        auto offsets = _at<std::uint64_t>(_string_offsets);
+        auto chars = _at<char>(_string_bytes);
+        for (std::uint64_t i = 0; i < header.string_count; ++i)
+        {
+            if (offsets[i] >= offsets[i + 1] || offsets[i + 1] > header.string_bytes
+                || chars[offsets[i + 1] - 1] != '\0')
+            {
+                _fail("the string table is malformed");
+            }
+        }
+        if (offsets[0] != 0 || offsets[1] != 1)
+        {
+            _fail("the string table is malformed");
+        }
+    }
+
+    const snapshot_header & header() const
+    {
+        return *_at<snapshot_header>(0);
+    }
+
+    std::string_view string(std::uint64_t index) const
+    {
+        if (index >= header().string_count)
+        {
+            throw std::out_of_range("guilt::graph_snapshot: invalid string index");
+        }
+        auto offsets = _at<std::uint64_t>(_string_offsets);
+        return { _at<char>(_string_bytes) + offsets[index], offsets[index + 1] - offsets[index] - 1 };
+    }
+
+    std::span<const snapshot_cluster> clusters() const
+    {
+        return { _at<snapshot_cluster>(_clusters), header().cluster_count };
+    }
+
+    std::span<const snapshot_node> nodes() const
+    {
+        return { _at<snapshot_node>(_nodes), header().node_count };
+    }
+
+    std::span<const snapshot_edge> edges() const
+    {
+        return { _at<snapshot_edge>(_edges), header().edge_count };
+    }
+
+    // Writes the graph as it is at the time of the call, visiting every element once. The ids in the snapshot
+    // are the ids in the graph, and keep their generations.
+    static void write(std::ostream & os, const dependency_graph & graph)
+    {
+        std::unique_lock<detail::sharded_shared_mutex> lock{ graph._mutex };
+
+        auto cluster_count = graph._cluster_count.load(std::memory_order_acquire);
+        auto node_count = graph._node_slots();
+
+        std::vector<const dependency_graph::edge *> edges;
+        graph._for_each_edge([&](const dependency_graph::edge & edge) { edges.push_back(&edge); });
+
+        // The graph's strings keep their indices; file names, which the graph only points to, follow them.
+        std::vector<std::string_view> strings;
+        for (std::size_t i = 0; i < graph._strings.size(); ++i)
+        {
+            strings.push_back(graph._strings[i]);
+        }
+
+        // The graph's positions in the order can have gaps; the snapshot stores their ranks instead.
+        std::vector<std::size_t> by_order(node_count);
+        std::iota(by_order.begin(), by_order.end(), 0);
+        std::sort(
+            by_order.begin(),
+            by_order.end(),
+            [&](std::size_t lhs, std::size_t rhs) { return graph._order_of(lhs) < graph._order_of(rhs); });
+        std::vector<std::uint64_t> order(node_count);
+        for (std::size_t i = 0; i < node_count; ++i)
+        {
+            order[by_order[i]] = i;
+        }
+
+        std::unordered_map<std::string_view, std::uint64_t> files;
+        auto add_file = [&](source_location loc)
+        {
+            if (loc && files.try_emplace(loc.file_name, strings.size()).second)
+            {
+                strings.push_back(loc.file_name);
+            }
+        };
+        auto file_of = [&](source_location loc) { return loc ? files.at(loc.file_name) : 0; };
+
+        std::vector<std::uint64_t> cluster_of(node_count, snapshot_format::none);
+        for (std::size_t i = 0; i < cluster_count; ++i)
+        {
+            add_file(graph._clusters[i].loc);
+            for (auto && child : graph._clusters[i].child_nodes)
+            {
+                cluster_of[child.id] = i;
+            }
+        }
+        for (std::size_t i = 0; i < node_count; ++i)
+        {
+            add_file(graph._node_details[i].loc);
+        }
+        for (auto edge : edges)
+        {
+            add_file(edge->loc);
+        }
+
+        std::vector<std::uint64_t> string_offsets{ 0 };
+        string_offsets.reserve(strings.size() + 1);
+        for (auto && str : strings)
+        {
+            string_offsets.push_back(string_offsets.back() + str.size() + 1);
+        }
+
+        auto write_raw = [&](const auto * data, std::size_t count)
+        { os.write(reinterpret_cast<const char *>(data), sizeof(*data) * count); };
+
+        snapshot_header header{};
+        std::memcpy(header.magic, snapshot_format::magic, sizeof(header.magic));
+        header.version = snapshot_format::version;
+        header.byte_order = snapshot_format::byte_order;
+        header.string_count = strings.size();
+        header.string_bytes = string_offsets.back();
+        header.cluster_count = cluster_count;
+        header.node_count = node_count;
+        header.edge_count = edges.size();
+        write_raw(&header, 1);
+        write_raw(string_offsets.data(), string_offsets.size());
+
+        for (std::size_t i = 0; i < cluster_count; ++i)
+        {
+            auto & cluster = graph._clusters[i];
+            snapshot_cluster record{};
+            record.name = cluster.name;
+            record.description = cluster.description;
+            record.file = file_of(cluster.loc);
+            record.parent = cluster.parent ? cluster.parent->id : snapshot_format::none;
+            record.line = cluster.loc.line;
+            record.generation = cluster.id.generation;
+            record.flags = _flags(cluster.free, cluster.retired.load(std::memory_order_relaxed));
+            write_raw(&record, 1);
+        }
+
+        for (std::size_t i = 0; i < node_count; ++i)
+        {
+            auto & node = graph._node_details[i];
+            auto & slot = graph._nodes[i];
+            snapshot_node record{};
+            record.name = node.name;
+            record.description = node.description;
+            record.file = file_of(node.loc);
+            record.cluster = cluster_of[i];
+            record.order = order[i];
+            record.line = node.loc.line;
+            record.generation = slot.generation;
+            record.kind = static_cast<std::uint8_t>(node.kind);
+            record.flags = _flags(slot.free, slot.retired.load(std::memory_order_relaxed));
+            write_raw(&record, 1);
+        }
+
+        for (auto edge : edges)
+        {
+            snapshot_edge record{};
+            record.from = edge->from.id;
+            record.to = edge->to.id;
+            record.label = edge->label;
+            record.file = file_of(edge->loc);
+            record.hits = edge->statistics.hits;
+            record.first_seen = edge->statistics.first_seen;
+            record.last_seen = edge->statistics.last_seen;
+            record.line = edge->loc.line;
+            record.type = static_cast<std::uint8_t>(edge->type);
+            write_raw(&record, 1);
+        }
+
+        for (auto && str : strings)
+        {
+            os.write(str.data(), str.size());
+            os.put('\0');
+        }
+    }
+
+    // Recreates the snapshot in an empty graph, with the same ids, so that it can be queried and exported
+    // like the graph it was taken from. Edges are not checked for cycles one by one; instead, the topological
+    // order stored with the nodes is restored after checking that it is one. A graph that merges duplicate
+    // edges merges those of the snapshot, too.
+    void load(dependency_graph & graph) const
+    {
+        std::unique_lock<detail::sharded_shared_mutex> lock{ graph._mutex };
+        if (graph._node_slots() || graph._edge_slots()
+            || graph._cluster_count.load(std::memory_order_acquire))
+        {
+            throw std::logic_error("guilt::graph_snapshot: can only be loaded into an empty graph");
+        }
+
+        _check_records();
+
+        // The graph only points to file names, so they are kept in its string table, which never moves them.
+        auto location = [&](std::uint64_t file, std::uint32_t line)
+        {
+            if (!file)
+            {
+                return source_location{};
+            }
+            return source_location{ graph._strings[graph._strings.intern(string(file))].c_str(), line };
+        };
+
+        // Reclaimed slots are only handed back once all of them are taken, so that every id stays in place.
+        std::vector<std::size_t> free_clusters;
+        for (auto && record : clusters())
+        {
+            auto id = graph._add_cluster(
+                string(record.name), string(record.description), location(record.file, record.line));
+            auto & cluster = graph._clusters[id.id];
+            cluster.id.generation = record.generation;
+            cluster.retired.store(record.flags & snapshot_format::retired, std::memory_order_relaxed);
+            if (record.flags & snapshot_format::reclaimed)
+            {
+                cluster.free = true;
+                free_clusters.push_back(id.id);
+            }
+        }
+
+        auto clusters = this->clusters();
+        for (std::size_t i = 0; i < clusters.size(); ++i)
+        {
+            if (clusters[i].parent != snapshot_format::none)
+            {
+                auto & cluster = graph._clusters[i];
+                auto & parent = graph._clusters[clusters[i].parent];
+                cluster.parent = parent.id;
+                parent.child_clusters.push_back(cluster.id);
+            }
+        }
+
+        std::vector<std::size_t> free_nodes;
+        for (auto && record : nodes())
+        {
+            auto id = graph._add_node(
+                string(record.name),
+                string(record.description),
+                location(record.file, record.line),
+                static_cast<node_kind>(record.kind));
+            graph._ordering[id.id].order.store(record.order, std::memory_order_relaxed);
+            auto & slot = graph._nodes[id.id];
+            slot.generation = record.generation;
+            if (record.flags & snapshot_format::retired)
+            {
+                slot.retired.store(true, std::memory_order_relaxed);
+                graph._retired_count.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (record.flags & snapshot_format::reclaimed)
+            {
+                slot.free = true;
+                free_nodes.push_back(id.id);
+            }
+
+            if (record.cluster != snapshot_format::none)
+            {
+                graph._clusters[record.cluster].child_nodes.push_back(graph._id_at(id.id));
+            }
+        }
+
+        for (auto i : free_clusters)
+        {
+            graph._free_clusters.put(i);
+        }
+        for (auto i : free_nodes)
+        {
+            graph._free_nodes.put(i);
+        }
+
+        auto nodes = this->nodes();
+        for (auto && record : edges())
+        {
+            graph._insert_edge(
+                node_id{ record.from, nodes[record.from].generation },
+                node_id{ record.to, nodes[record.to].generation },
+                static_cast<edge_type>(record.type),
+                string(record.label),
+                location(record.file, record.line),
+                edge_statistics{ record.hits, record.first_seen, record.last_seen });
+        }
+    }
+
+private:
+    static std::uint8_t _flags(bool reclaimed, bool retired)
+    {
+        return (reclaimed ? snapshot_format::reclaimed : 0) | (retired ? snapshot_format::retired : 0);
+    }
+
+    [[noreturn]] static void _fail(const char * what)
+    {
+        throw std::invalid_argument(std::string("guilt::graph_snapshot: ") + what);
+    }
+
+    // Everything load() relies on, checked up front so that a bad snapshot leaves the graph empty.
+    void _check_records() const
+    {
+        auto clusters = this->clusters();
+        auto nodes = this->nodes();
+        auto strings = header().string_count;
+
+        auto reclaimed = [](auto && record) { return record.flags & snapshot_format::reclaimed; };
+
+        for (std::size_t i = 0; i < clusters.size(); ++i)
+        {
+            auto & record = clusters[i];
+            if (record.name >= strings || record.description >= strings || record.file >= strings)
+            {
+                _fail("invalid string index");
+            }
+            if (record.parent != snapshot_format::none && record.parent >= clusters.size())
+            {
+                _fail("invalid cluster id");
+            }
+            if (record.parent != snapshot_format::none
+                && (reclaimed(record) || reclaimed(clusters[record.parent])))
+            {
+                _fail("a reclaimed cluster is still part of the graph");
+            }
+        }
+
+        // Once ids are reused, a parent can come after its children, but they must not form a cycle.
+        enum class walk : std::uint8_t
+        {
+            unvisited,
+            on_chain,
+            done
+        };
+        std::vector<walk> walked(clusters.size());
+        std::vector<std::size_t> chain;
+        for (std::size_t i = 0; i < clusters.size(); ++i)
+        {
+            chain.clear();
+            auto j = i;
+            while (j != snapshot_format::none && walked[j] == walk::unvisited)
+            {
+                walked[j] = walk::on_chain;
+                chain.push_back(j);
+                j = clusters[j].parent;
+            }
+            if (j != snapshot_format::none && walked[j] == walk::on_chain)
+            {
+                _fail("the cluster parents form a cycle");
+            }
+            for (auto c : chain)
+            {
+                walked[c] = walk::done;
+            }
+        }
+
+        std::vector<bool> order_taken(nodes.size());
+        for (auto && record : nodes)
+        {
+            if (record.name >= strings || record.description >= strings || record.file >= strings)
+            {
+                _fail("invalid string index");
+            }
+            if (record.cluster != snapshot_format::none && record.cluster >= clusters.size())
+            {
+                _fail("invalid cluster id");
+            }
+            if (record.cluster != snapshot_format::none
+                && (reclaimed(record) || reclaimed(clusters[record.cluster])))
+            {
+                _fail("a reclaimed node or cluster is still part of the graph");
+            }
+            if (record.kind > static_cast<std::uint8_t>(node_kind::cancelled))
+            {
+                _fail("invalid node kind");
+            }
+            if (record.order >= nodes.size() || order_taken[record.order])
+            {
+                _fail("the node order is not a permutation");
+            }
+            order_taken[record.order] = true;
+        }
+
+        for (auto && record : edges())
+        {
+            if (record.label >= strings || record.file >= strings)
+            {
+                _fail("invalid string index");
+            }
+            if (record.from >= nodes.size() || record.to >= nodes.size())
+            {
+                _fail("invalid node id");
+            }
+            if (record.type > static_cast<std::uint8_t>(edge_type::summary))
+            {
+                _fail("invalid edge type");
+            }
+            if (reclaimed(nodes[record.from]) || reclaimed(nodes[record.to]))
+            {
+                _fail("an edge touches a reclaimed node");
+            }
+            if (nodes[record.from].order >= nodes[record.to].order)
+            {
+                _fail("an edge goes against the node order");
+            }
+        }
+    }
+
+    template<typename T>
+    const T * _at(std::size_t offset) const
+    {
+        return reinterpret_cast<const T *>(_bytes.data() + offset);
+    }
+
+    std::span<const std::byte> _bytes;
+    std::size_t _string_offsets = 0;
+    std::size_t _clusters = 0;
+    std::size_t _nodes = 0;
+    std::size_t _edges = 0;
+    std::size_t _string_bytes = 0;
+};
+}
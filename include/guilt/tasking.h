@@ -1,11 +1,22 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
-#include <queue>
+#include <stdexcept>
+#include <thread>
 #include <tuple>
+#include <utility>
 #include <variant>
+#include <vector>
 
 #include <iostream>
 
@@ -34,6 +45,8 @@ namespace coro = std::experimental;
 
 #include <reaver/function.h>
 
+#include "frame_allocation.h"
+
 namespace guilt
 {
 namespace detail
@@ -68,8 +81,175 @@ namespace detail
     }
 }
 
+class execution_context;
+
+// Contexts that order their work run higher priorities first; the others only carry the priority along.
+enum class task_priority : std::uint8_t
+{
+    background,
+    normal,
+    high,
+    critical
+};
+
+constexpr std::size_t task_priority_levels = 4;
+
+namespace detail
+{
+    struct scheduling_state
+    {
+        execution_context * context = nullptr;
+        std::size_t inline_depth = 0;
+        task_priority priority = task_priority::normal;
+    };
+
+    // What the current thread is running on behalf of, and at what priority, and how many coroutines have
+    // been resumed inline since it last returned to an execution_context's loop.
+    inline thread_local scheduling_state this_thread_scheduling;
+
+    // Symmetric transfer is only guaranteed not to grow the stack when the compiler emits it as a tail call;
+    // past this many inline resumptions, continuations go back through the queue instead.
+    constexpr std::size_t max_inline_depth = 64;
+}
+
 class execution_context
 {
+protected:
+    using Callback = reaver::unique_function<void()>;
+
+    // A unit of work: either a coroutine to resume, or an arbitrary callback when handle is null.
+    struct job
+    {
+        coro::coroutine_handle<> handle = nullptr;
+        Callback callback = {};
+        task_priority priority = task_priority::normal;
+
+        void operator()()
+        {
+            if (handle)
+            {
+                handle.resume();
+            }
+            else
+            {
+                callback();
+            }
+        }
+    };
+
+    // A double ended queue of jobs. Coroutine handles are stored directly in a ring buffer, so scheduling a
+    // resumption does not type erase or allocate once the ring has grown to its working size; callbacks are
+    // kept on the side, with a null handle in the ring marking their position. Priorities are kept in a
+    // second ring, for contexts to carry them over to the jobs they run.
+    class ready_queue
+    {
+    public:
+        bool empty() const
+        {
+            return _size == 0;
+        }
+
+        std::size_t size() const
+        {
+            return _size;
+        }
+
+        void push_back(coro::coroutine_handle<> h, task_priority priority = task_priority::normal)
+        {
+            assert(h);
+            _push_back(h, priority);
+        }
+
+        void push_back(Callback cb, task_priority priority = task_priority::normal)
+        {
+            _callbacks.push_back(std::move(cb));
+            _push_back(nullptr, priority);
+        }
+
+        void push_back(job j)
+        {
+            if (j.handle)
+            {
+                push_back(j.handle, j.priority);
+            }
+            else
+            {
+                push_back(std::move(j.callback), j.priority);
+            }
+        }
+
+        job pop_front()
+        {
+            assert(!empty());
+            auto h = _ring[_head];
+            auto priority = _priorities[_head];
+            _head = (_head + 1) & (_ring.size() - 1);
+            --_size;
+
+            if (h)
+            {
+                return job{ h, {}, priority };
+            }
+
+            auto cb = std::move(_callbacks.front());
+            _callbacks.pop_front();
+            return job{ nullptr, std::move(cb), priority };
+        }
+
+        job pop_back()
+        {
+            assert(!empty());
+            --_size;
+            auto index = (_head + _size) & (_ring.size() - 1);
+            auto h = _ring[index];
+
+            if (h)
+            {
+                return job{ h, {}, _priorities[index] };
+            }
+
+            auto cb = std::move(_callbacks.back());
+            _callbacks.pop_back();
+            return job{ nullptr, std::move(cb), _priorities[index] };
+        }
+
+    private:
+        void _push_back(coro::coroutine_handle<> h, task_priority priority)
+        {
+            if (_size == _ring.size())
+            {
+                _grow();
+            }
+
+            auto index = (_head + _size) & (_ring.size() - 1);
+            _ring[index] = h;
+            _priorities[index] = priority;
+            ++_size;
+        }
+
+        void _grow()
+        {
+            auto capacity = std::max<std::size_t>(_ring.size() * 2, 64);
+            std::vector<coro::coroutine_handle<>> ring(capacity);
+            std::vector<task_priority> priorities(capacity);
+            for (std::size_t i = 0; i < _size; ++i)
+            {
+                ring[i] = _ring[(_head + i) & (_ring.size() - 1)];
+                priorities[i] = _priorities[(_head + i) & (_ring.size() - 1)];
+            }
+
+            _ring = std::move(ring);
+            _priorities = std::move(priorities);
+            _head = 0;
+        }
+
+        std::vector<coro::coroutine_handle<>> _ring;
+        std::vector<task_priority> _priorities;
+        std::size_t _head = 0;
+        std::size_t _size = 0;
+        std::deque<Callback> _callbacks;
+    };
+
 public:
     class executor
     {
@@ -78,10 +258,20 @@ public:
         {
         }
 
+        // Jobs run at the priority they are queued with, which is the one of the job queuing them unless said
+        // otherwise.
         template<typename F>
-        void execute(F && f)
+        void execute(F && f, task_priority priority = detail::this_thread_scheduling.priority)
+        {
+            _ctx->_enqueue(Callback{ std::forward<F>(f) }, priority);
+        }
+
+        // Cheaper equivalent of execute([h]() mutable { h(); }).
+        void schedule(
+            coro::coroutine_handle<> h,
+            task_priority priority = detail::this_thread_scheduling.priority)
         {
-            _ctx->_callbacks.push(std::forward<F>(f));
+            _ctx->_enqueue(h, priority);
         }
 
     private:
@@ -90,47 +280,219 @@ public:
 
     friend class executor;
 
+    execution_context() = default;
+    execution_context(const execution_context &) = delete;
+    execution_context & operator=(const execution_context &) = delete;
+
+    virtual ~execution_context() = default;
+
     executor get_executor()
     {
         return executor{ this };
     }
 
-    void handle_single()
+    // The context whose callback is running on this thread, if any.
+    static execution_context * current()
+    {
+        return detail::this_thread_scheduling.context;
+    }
+
+    // The priority of the job running on this thread, which the work it queues inherits.
+    static task_priority current_priority()
+    {
+        return detail::this_thread_scheduling.priority;
+    }
+
+    bool handle_single()
     {
-        _callbacks.front()();
-        _callbacks.pop();
+        return _handle_one();
     }
 
     void handle_all()
     {
-        while (_callbacks.size())
+        while (_handle_one())
         {
-            handle_single();
         }
     }
 
     template<typename F>
     void handle_all_until(F && f)
     {
-        while (_callbacks.size() && !f())
+        while (!f() && _handle_one())
+        {
+        }
+    }
+
+    // Like handle_all_until, except that running out of work does not stop it: it waits for other threads,
+    // or other contexts, to queue more until f() returns true.
+    template<typename F>
+    void run_until(F && f)
+    {
+        while (!f())
+        {
+            if (!_handle_one())
+            {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+protected:
+    // Jobs queued by the context's own jobs go straight to the ready queue, which only the thread running the
+    // context touches; everybody else, including that thread when it is outside of handle_*, goes through
+    // a locked queue that gets moved over once the context looks for more work.
+    virtual void _enqueue(Callback cb, task_priority priority)
+    {
+        if (_is_running_here())
+        {
+            _ready.push_back(std::move(cb), priority);
+            return;
+        }
+
+        _inject(job{ nullptr, std::move(cb), priority });
+    }
+
+    virtual void _enqueue(coro::coroutine_handle<> h, task_priority priority)
+    {
+        if (_is_running_here())
+        {
+            _ready.push_back(h, priority);
+            return;
+        }
+
+        _inject(job{ h, {}, priority });
+    }
+
+    bool _is_running_here() const
+    {
+        return detail::this_thread_scheduling.context == this;
+    }
+
+    void _inject(job j)
+    {
+        std::lock_guard<std::mutex> lock{ _injection_mutex };
+        _injected.push_back(std::move(j));
+        _has_injected.store(true, std::memory_order_release);
+    }
+
+    // Hands the jobs queued by other threads to f, oldest first.
+    template<typename F>
+    void _take_injected(F && f)
+    {
+        if (!_has_injected.load(std::memory_order_acquire))
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock{ _injection_mutex };
+        while (!_injected.empty())
+        {
+            f(_injected.pop_front());
+        }
+        _has_injected.store(false, std::memory_order_relaxed);
+    }
+
+    // Runs at most one job. Returns false only when the context has gone idle, i.e. there is nothing queued
+    // and nothing that could still queue more work is running.
+    virtual bool _handle_one()
+    {
+        _take_injected([&](job j) { _ready.push_back(std::move(j)); });
+
+        if (_ready.empty())
+        {
+            return false;
+        }
+
+        auto next = _ready.pop_front();
+        _run(next);
+        return true;
+    }
+
+    void _run(job & j)
+    {
+        auto & state = detail::this_thread_scheduling;
+        auto saved = std::exchange(state, { this, 0, j.priority });
+
+        try
         {
-            handle_single();
+            j();
         }
+        catch (...)
+        {
+            state = saved;
+            throw;
+        }
+
+        state = saved;
     }
 
 private:
-    using Callback = reaver::unique_function<void()>;
-    std::queue<Callback> _callbacks;
+    ready_queue _ready;
+
+    std::mutex _injection_mutex;
+    ready_queue _injected;
+    std::atomic<bool> _has_injected = false;
 };
 
-execution_context & global_execution_context()
+namespace detail
+{
+    inline std::atomic<execution_context *> & global_execution_context_pointer()
+    {
+        static execution_context default_context;
+        static std::atomic<execution_context *> pointer{ &default_context };
+        return pointer;
+    }
+}
+
+inline execution_context & global_execution_context()
+{
+    return *detail::global_execution_context_pointer().load(std::memory_order_acquire);
+}
+
+// Replaces the context that tasks are started and resumed on. Returns the previously installed one.
+inline execution_context & set_global_execution_context(execution_context & ctx)
 {
-    static execution_context gl;
-    return gl;
+    return *detail::global_execution_context_pointer().exchange(&ctx, std::memory_order_acq_rel);
 }
 
 namespace detail
 {
+    // An intrusive node of the lock-free continuation stack kept by shared_state. Awaiters embed one of
+    // these, so registering a continuation does not allocate.
+    struct continuation
+    {
+        continuation * next = nullptr;
+
+        // Runs the continuation. It may also hand back a coroutine that is ready to continue on the context
+        // running on this thread, for the caller to resume or queue there.
+        coro::coroutine_handle<> (*invoke)(continuation *) = nullptr;
+
+        // Set when the continuation just resumes a coroutine that was running on context; the completing side
+        // may then resume it directly instead of calling invoke.
+        coro::coroutine_handle<> handle = nullptr;
+        execution_context * context = nullptr;
+
+        // The priority of the coroutine that gets resumed, if any.
+        task_priority priority = task_priority::normal;
+    };
+
+    template<typename F>
+    struct functor_continuation : continuation
+    {
+        functor_continuation(F f) : continuation{ nullptr, &_invoke }, f(std::move(f))
+        {
+        }
+
+        static coro::coroutine_handle<> _invoke(continuation * self)
+        {
+            std::unique_ptr<functor_continuation> owned{ static_cast<functor_continuation *>(self) };
+            owned->f();
+            return nullptr;
+        }
+
+        F f;
+    };
+
     template<typename T>
     class shared_state
     {
@@ -140,23 +502,75 @@ namespace detail
         };
 
     public:
+        shared_state() = default;
+        shared_state(const shared_state &) = delete;
+        shared_state & operator=(const shared_state &) = delete;
+
         void set_value(T t)
         {
-            assert(_state.index() == 0);
-            _state = value_type{ std::move(t) };
-            _invoke_continuations();
+            store_value(std::move(t));
+            _invoke_continuations(publish());
         }
 
         void set_exception(std::exception_ptr ex)
         {
-            assert(_state.index() == 0);
-            _state = std::move(ex);
-            _invoke_continuations();
+            store_exception(std::move(ex));
+            _invoke_continuations(publish());
+        }
+
+        // The two step version of the above: store the result first, then make it visible with publish(),
+        // which returns the registered continuations in registration order for the caller to run.
+        void store_value(T t)
+        {
+            assert(!is_ready());
+            _state.template emplace<1>(value_type{ std::move(t) });
+        }
+
+        void store_exception(std::exception_ptr ex)
+        {
+            assert(!is_ready());
+            _state.template emplace<2>(std::move(ex));
+        }
+
+        continuation * publish()
+        {
+            auto head = _continuations.exchange(_ready(), std::memory_order_acq_rel);
+
+            // The stack hands the continuations back newest first.
+            continuation * ordered = nullptr;
+            while (head)
+            {
+                auto next = head->next;
+                head->next = ordered;
+                ordered = head;
+                head = next;
+            }
+
+            return ordered;
         }
 
         bool is_ready() const
         {
-            return _state.index() != 0;
+            return _continuations.load(std::memory_order_acquire) == _ready();
+        }
+
+        // Returns false, without registering c, if the state is already ready; the caller has to continue on
+        // its own in that case.
+        bool try_add_continuation(continuation & c)
+        {
+            auto head = _continuations.load(std::memory_order_acquire);
+            do
+            {
+                if (head == _ready())
+                {
+                    return false;
+                }
+
+                c.next = head;
+            } while (!_continuations.compare_exchange_weak(
+                head, &c, std::memory_order_release, std::memory_order_acquire));
+
+            return true;
         }
 
         template<typename F>
@@ -165,234 +579,1499 @@ namespace detail
             if (is_ready())
             {
                 std::forward<F>(f)();
+                return;
             }
 
-            _continuations.push_back(std::forward<F>(f));
+            auto node = new functor_continuation<std::decay_t<F>>{ std::forward<F>(f) };
+            if (!try_add_continuation(*node))
+            {
+                node->invoke(node);
+            }
         }
 
         const T & get_value() const
         {
-            assert(_state.index() > 0);
+            assert(is_ready());
             if (_state.index() == 1)
             {
                 return std::get<1>(_state).value;
             }
             else
             {
-                std::rethrow_exception(std::move(std::get<2>(_state)));
+                std::rethrow_exception(std::get<2>(_state));
             }
         }
 
     private:
-        void _invoke_continuations()
+        continuation * _ready() const
         {
-            auto cs = std::move(_continuations);
-            for (auto && c : cs)
+            return reinterpret_cast<continuation *>(const_cast<shared_state *>(this));
+        }
+
+        static void _invoke_continuations(continuation * c)
+        {
+            while (c)
             {
-                c();
+                auto next = c->next;
+                if (auto h = c->invoke(c))
+                {
+                    h.resume();
+                }
+                c = next;
             }
         }
 
         std::variant<std::monostate, value_type, std::exception_ptr> _state;
-
-        using Continuation = reaver::unique_function<void()>;
-        std::vector<Continuation> _continuations;
+        std::atomic<continuation *> _continuations = nullptr;
     };
 }
 
-template<typename T>
-class task;
-
-template<typename T = void>
-class promise_base
+namespace detail
 {
-public:
-    using task_type = task<T>;
-
-    friend class task<T>;
-
-    promise_base() : _self(coro::coroutine_handle<promise_base<T>>::from_promise(*this))
+    // Queues h on ctx, or on the global context if ctx is null.
+    inline void enqueue(
+        execution_context * ctx,
+        coro::coroutine_handle<> h,
+        task_priority priority = this_thread_scheduling.priority)
     {
+        (ctx ? *ctx : global_execution_context()).get_executor().schedule(h, priority);
     }
 
-    promise_base(coro::coroutine_handle<> self) : _self(self)
+    // Runs a completed state's continuations. At most one of them - the first one that resumes a coroutine on
+    // the context running on this thread, or hands one back from invoke - is returned to be resumed through
+    // symmetric transfer; the rest, and all of them once the inline depth limit is hit, are invoked, which
+    // queues them on their own contexts.
+    inline coro::coroutine_handle<> resume_continuations(continuation * c)
     {
-    }
-
-    promise_base(const promise_base &) = delete;
-    promise_base(promise_base &&) = delete;
-    promise_base & operator=(const promise_base &) = delete;
-    promise_base & operator=(promise_base &&) = delete;
+        auto & state = this_thread_scheduling;
+        coro::coroutine_handle<> next = nullptr;
 
-    void set_value(::guilt::detail::replace_void_t<T> val = {})
-    {
-        _state.set_value(std::move(val));
-    }
+        while (c)
+        {
+            auto following = c->next;
+            if (!next && c->handle && c->context == state.context && state.inline_depth < max_inline_depth)
+            {
+                next = c->handle;
+                ++state.inline_depth;
+                state.priority = c->priority;
+            }
+            else if (auto h = c->invoke(c))
+            {
+                if (!next && state.inline_depth < max_inline_depth)
+                {
+                    next = h;
+                    ++state.inline_depth;
+                    state.priority = c->priority;
+                }
+                else
+                {
+                    enqueue(state.context, h, c->priority);
+                }
+            }
+            c = following;
+        }
 
-    void set_exception(std::exception_ptr ex)
-    {
-        _state.set_exception(ex);
+        return next ? next : coro::noop_coroutine();
     }
+}
 
-    coro::suspend_always initial_suspend() noexcept
+// Thrown from the cancellation points of a task whose cancellation token has been cancelled.
+class operation_cancelled : public std::exception
+{
+public:
+    const char * what() const noexcept override
     {
-        return {};
+        return "operation cancelled";
     }
+};
 
-    coro::suspend_always final_suspend() noexcept
+namespace detail
+{
+    // Shared by a cancellation_source and its tokens. A source made from another token holds a reference to
+    // that token's state and counts as cancelled once it is; cancellation is only ever polled, so nothing
+    // has to be registered with the parent, or taken back from it.
+    struct cancellation_state
     {
-        return {};
-    }
+        explicit cancellation_state(cancellation_state * parent = nullptr) : parent{ parent }
+        {
+        }
 
-    auto get_return_object()
-    {
-        return task<T>{ this };
-    }
+        bool is_cancelled() const
+        {
+            for (auto state = this; state; state = state->parent)
+            {
+                if (state->cancelled.load(std::memory_order_acquire))
+                {
+                    return true;
+                }
+            }
 
-    void unhandled_exception()
-    {
-        set_exception(std::current_exception());
-    }
+            return false;
+        }
 
-private:
-    detail::shared_state<::guilt::detail::replace_void_t<T>> _state;
-    coro::coroutine_handle<> _self;
-    std::size_t _refcount = 0;
-};
+        static cancellation_state * acquire(cancellation_state * state)
+        {
+            if (state)
+            {
+                state->references.fetch_add(1, std::memory_order_relaxed);
+            }
+            return state;
+        }
 
-template<typename T = void>
-class promise : public promise_base<T>
+        static void release(cancellation_state * state)
+        {
+            while (state && state->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                delete std::exchange(state, state->parent);
+            }
+        }
+
+        std::atomic<std::size_t> references = 1;
+        std::atomic<bool> cancelled = false;
+        cancellation_state * parent;
+    };
+}
+
+template<typename T>
+class promise_base;
+
+class cancellation_source;
+
+// Lets a task find out that its work is no longer needed. Default constructed tokens are never cancelled.
+// Awaiting a token is a cancellation point: it completes right away, with operation_cancelled if the token
+// has been cancelled.
+class cancellation_token
 {
 public:
-    using promise_base<T>::promise_base;
+    template<typename T>
+    friend class promise_base;
+    friend class cancellation_source;
 
-    void return_value(::guilt::detail::replace_void_t<T> t)
+    cancellation_token() = default;
+
+    cancellation_token(const cancellation_token & other) : _state{ other._acquire() }
     {
-        this->set_value(std::move(t));
     }
+
+    cancellation_token & operator=(const cancellation_token & other)
+    {
+        if (this != &other)
+        {
+            detail::cancellation_state::release(_state.exchange(other._acquire(), std::memory_order_acq_rel));
+        }
+
+        return *this;
+    }
+
+    ~cancellation_token()
+    {
+        detail::cancellation_state::release(_state.load(std::memory_order_relaxed));
+    }
+
+    bool can_be_cancelled() const
+    {
+        return _state.load(std::memory_order_acquire);
+    }
+
+    bool is_cancelled() const
+    {
+        auto state = _state.load(std::memory_order_acquire);
+        return state && state->is_cancelled();
+    }
+
+    void throw_if_cancelled() const
+    {
+        if (is_cancelled())
+        {
+            throw operation_cancelled{};
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return true;
+    }
+
+    void await_suspend(coro::coroutine_handle<>) const noexcept
+    {
+    }
+
+    void await_resume() const
+    {
+        throw_if_cancelled();
+    }
+
+private:
+    explicit cancellation_token(detail::cancellation_state * state) : _state{ state }
+    {
+    }
+
+    detail::cancellation_state * _acquire() const
+    {
+        return detail::cancellation_state::acquire(_state.load(std::memory_order_acquire));
+    }
+
+    // Takes other's state over, unless this token has one already. A state is only ever installed over null,
+    // so this is safe while the owning task runs and polls the token on another thread.
+    void _inherit(const cancellation_token & other)
+    {
+        if (_state.load(std::memory_order_acquire))
+        {
+            return;
+        }
+
+        auto state = other._acquire();
+        detail::cancellation_state * expected = nullptr;
+        if (state && !_state.compare_exchange_strong(expected, state, std::memory_order_acq_rel))
+        {
+            detail::cancellation_state::release(state);
+        }
+    }
+
+    std::atomic<detail::cancellation_state *> _state = nullptr;
 };
 
-template<>
-class promise<void> : public promise_base<void>
+// Cancels the tokens it hands out. A source made from a token is also cancelled once that token is, which is
+// how a part of the work can be cancelled on its own without leaving the rest behind. Copies share their
+// state.
+class cancellation_source
 {
 public:
-    using promise_base<void>::promise_base;
+    cancellation_source() : _token{ new detail::cancellation_state }
+    {
+    }
 
-    void return_void()
+    explicit cancellation_source(const cancellation_token & parent)
+        : _token{ new detail::cancellation_state{ parent._acquire() } }
     {
-        set_value({});
     }
+
+    cancellation_token get_token() const
+    {
+        return _token;
+    }
+
+    // Tasks see the request at their next cancellation point; whatever they do until then runs to completion.
+    void cancel()
+    {
+        _token._state.load(std::memory_order_relaxed)->cancelled.store(true, std::memory_order_release);
+    }
+
+    bool is_cancelled() const
+    {
+        return _token.is_cancelled();
+    }
+
+private:
+    cancellation_token _token;
 };
 
-template<typename T = void>
-class task
+// Awaited in a task for the task's own cancellation token, as it is at that point: a task awaited by another
+// one takes the awaiting task's token over at the time it is awaited, unless it was given one before.
+constexpr inline struct get_cancellation_token_t
 {
-    task(promise_base<T> * promise) : _promise{ promise }
+} get_cancellation_token;
+
+template<typename T>
+class task;
+
+namespace detail
+{
+    class fan_in;
+    class race;
+
+    template<typename Awaiter>
+    class cancellable_awaiter
+    {
+    public:
+        cancellable_awaiter(Awaiter awaiter, const cancellation_token & token)
+            : _awaiter{ std::forward<Awaiter>(awaiter) }, _token{ token }
+        {
+        }
+
+        bool await_ready()
+        {
+            _cancelled = _token.is_cancelled();
+            return _cancelled || _awaiter.await_ready();
+        }
+
+        auto await_suspend(coro::coroutine_handle<> h)
+        {
+            return _awaiter.await_suspend(h);
+        }
+
+        decltype(auto) await_resume()
+        {
+            if (_cancelled || _token.is_cancelled())
+            {
+                throw operation_cancelled{};
+            }
+            return _awaiter.await_resume();
+        }
+
+    private:
+        Awaiter _awaiter;
+        const cancellation_token & _token;
+        bool _cancelled = false;
+    };
+
+    // Awaiting a task, or anything else that passes a cancellation token on to tasks, is a cancellation
+    // point: the awaited tasks inherit the token, and the awaiting coroutine gets operation_cancelled instead
+    // of their result once it has been cancelled, whether before suspending or while suspended. Everything
+    // else is awaited as it is.
+    template<typename Awaitable>
+    decltype(auto) make_cancellable(Awaitable && awaitable, const cancellation_token & token)
     {
-        _promise->_refcount += 1;
+        if constexpr (requires { awaitable.inherit_cancellation(token); })
+        {
+            awaitable.inherit_cancellation(token);
+            if constexpr (requires { std::forward<Awaitable>(awaitable).operator co_await(); })
+            {
+                auto && awaiter = std::forward<Awaitable>(awaitable).operator co_await();
+                using awaiter_type = std::remove_cvref_t<decltype(awaiter)>;
+                return cancellable_awaiter<awaiter_type>{ std::move(awaiter), token };
+            }
+            else
+            {
+                return cancellable_awaiter<Awaitable>{ std::forward<Awaitable>(awaitable), token };
+            }
+        }
+        else
+        {
+            return std::forward<Awaitable>(awaitable);
+        }
     }
+}
 
+template<typename T = void>
+class promise_base : public detail::frame_allocation
+{
 public:
-    using value_type = T;
-    using promise_type = promise<T>;
+    using task_type = task<T>;
 
-    template<typename Other>
-    using rebind = task<Other>;
+    friend class task<T>;
+    friend class detail::fan_in;
+    friend class detail::race;
 
-    friend class promise_base<T>;
+    promise_base() : _self(coro::coroutine_handle<promise_base<T>>::from_promise(*this))
+    {
+    }
 
-    task() = delete;
+    promise_base(coro::coroutine_handle<> self) : _self(self)
+    {
+    }
 
-    ~task()
+    promise_base(const promise_base &) = delete;
+    promise_base(promise_base &&) = delete;
+    promise_base & operator=(const promise_base &) = delete;
+    promise_base & operator=(promise_base &&) = delete;
+
+    // The result is published, and awaiters continued, once the coroutine reaches its final suspension point.
+    void set_value(::guilt::detail::replace_void_t<T> val = {})
     {
-        _release();
+        _state.store_value(std::move(val));
     }
 
-    task(const task & other) : _promise{ other._promise }
+    void set_exception(std::exception_ptr ex)
     {
-        _acquire();
+        _state.store_exception(ex);
     }
 
-    task(task && other) : _promise{ std::exchange(other._promise, nullptr) }
+    // Starting a task is a cancellation point: one cancelled before it gets to run completes right away.
+    auto initial_suspend() noexcept
     {
+        struct awaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            void await_suspend(coro::coroutine_handle<>) noexcept
+            {
+            }
+
+            void await_resume() const
+            {
+                self->_cancellation.throw_if_cancelled();
+            }
+
+            promise_base * self;
+        };
+
+        return awaiter{ this };
     }
 
-    task & operator=(const task & other)
+    auto final_suspend() noexcept
     {
-        _release();
-        _promise = other._promise;
-        _acquire();
+        struct awaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            coro::coroutine_handle<> await_suspend(coro::coroutine_handle<>) noexcept
+            {
+                // This frame, awaiter included, may be gone by the time _release returns.
+                auto promise = self;
+
+                // Coroutines that run eagerly can get here without ever being started.
+                promise->_refcount.fetch_or(_started_flag, std::memory_order_relaxed);
+                auto next = detail::resume_continuations(promise->_state.publish());
+                promise->_release();
+                return next;
+            }
+
+            void await_resume() noexcept
+            {
+            }
+
+            promise_base * self;
+        };
+
+        return awaiter{ this };
     }
 
-    task & operator=(task && other)
+    auto get_return_object()
     {
-        _release();
-        _promise = std::exchange(other._promise, nullptr);
+        return task<T>{ this };
     }
 
-    bool is_ready() const
+    void unhandled_exception()
     {
-        return _promise->_state.is_ready();
+        set_exception(std::current_exception());
     }
 
-    bool await_ready() const
+    template<typename Awaitable>
+    decltype(auto) await_transform(Awaitable && awaitable)
     {
-        return _promise->_state.is_ready();
+        return detail::make_cancellable(std::forward<Awaitable>(awaitable), _cancellation);
+    }
+
+    auto await_transform(get_cancellation_token_t)
+    {
+        struct awaitable
+        {
+            bool await_ready() const noexcept
+            {
+                return true;
+            }
+
+            void await_suspend(coro::coroutine_handle<>) const noexcept
+            {
+            }
+
+            cancellation_token await_resume() const
+            {
+                return token;
+            }
+
+            const cancellation_token & token;
+        };
+
+        return awaitable{ _cancellation };
     }
 
-    auto await_suspend(coro::coroutine_handle<> h)
+    // Has to happen before the coroutine is started or shared with other threads.
+    void set_priority(task_priority priority)
     {
-        _promise->_state.add_continuation(
-            [h = std::move(h)]() mutable
-            { global_execution_context().get_executor().execute([h = std::move(h)]() mutable { h(); }); });
-        return _promise->_self;
+        _priority = priority;
     }
 
-    ::guilt::detail::replace_void_t<T> await_resume()
+    // Has to happen before the coroutine is started or shared with other threads.
+    void set_cancellation_token(cancellation_token token)
     {
-        return _promise->_state.get_value();
+        _cancellation = std::move(token);
     }
 
-    void start()
+    const cancellation_token & get_cancellation_token() const
+    {
+        return _cancellation;
+    }
+
+    // Unlike set_cancellation_token, this can happen at any time; it does nothing if the coroutine already
+    // has a token, however it got it.
+    void inherit_cancellation(const cancellation_token & token)
     {
-        global_execution_context().get_executor().execute([h = _promise->_self]() mutable { h(); });
+        _cancellation._inherit(token);
     }
 
 private:
-    promise_base<T> * _promise;
+    bool _try_start()
+    {
+        return !(_refcount.fetch_or(_started_flag, std::memory_order_acq_rel) & _started_flag);
+    }
+
+    // For whoever won _try_start while running a job of ctx: a coroutine bound to another context, or given
+    // a priority other than the one of that job, is queued accordingly, and true is returned; running any
+    // other one is up to the caller.
+    bool _start_elsewhere(execution_context * ctx)
+    {
+        auto current = detail::this_thread_scheduling.priority;
+        bool other_context = _context && _context != ctx;
+        bool other_priority = _priority && *_priority != current;
+        if (!other_context && !other_priority)
+        {
+            return false;
+        }
+
+        detail::enqueue(other_context ? _context : ctx, _self, _priority.value_or(current));
+        return true;
+    }
 
     void _acquire()
     {
-        assert(_promise);
-        _promise->_refcount += 1;
+        _refcount.fetch_add(_reference, std::memory_order_relaxed);
     }
 
     void _release()
     {
-        if (!_promise)
-        {
-            return;
-        }
+        auto remaining = _refcount.fetch_sub(_reference, std::memory_order_acq_rel) - _reference;
 
-        _promise->_refcount -= 1;
-        if (!_promise->_refcount)
+        // Either this was the last reference, or the only one left is the one held by a coroutine that was
+        // never started - and with no handles left, nobody can start it anymore.
+        if (remaining == _started_flag || remaining == _reference)
         {
-            _promise->_self.destroy();
+            _self.destroy();
         }
     }
+
+    detail::shared_state<::guilt::detail::replace_void_t<T>> _state;
+    coro::coroutine_handle<> _self;
+
+    // The context the coroutine is started on, whoever starts it; null if it is not bound to one.
+    execution_context * _context = nullptr;
+    // Without a priority of its own, the coroutine runs at the priority of whoever starts it.
+    std::optional<task_priority> _priority;
+    cancellation_token _cancellation;
+
+    // The lowest bit is set once the coroutine has been started, the rest counts references. It starts at one
+    // reference: the running coroutine keeps itself alive until it reaches its final suspension point, so
+    // that handles can be dropped from any thread while it is still running.
+    static constexpr std::size_t _started_flag = 1;
+    static constexpr std::size_t _reference = 2;
+    std::atomic<std::size_t> _refcount = _reference;
 };
 
 template<typename T = void>
-task<T> make_ready_task(::guilt::detail::replace_void_t<T> val = {})
+class promise : public promise_base<T>
 {
-    auto ret = [val = std::move(val)]() mutable -> task<T> { co_return std::move(val); };
-    ret.start();
-    return ret;
-}
+public:
+    using promise_base<T>::promise_base;
 
-template<typename... Ts>
-task<std::tuple<::guilt::detail::replace_void_t<typename Ts::value_type>...>> when_all(Ts... ts)
+    void return_value(::guilt::detail::replace_void_t<T> t)
+    {
+        this->set_value(std::move(t));
+    }
+};
+
+template<>
+class promise<void> : public promise_base<void>
 {
-    co_return { (co_await ts)... };
+public:
+    using promise_base<void>::promise_base;
+
+    void return_void()
+    {
+        set_value({});
+    }
+};
+
+template<typename T = void>
+class task
+{
+    task(promise_base<T> * promise) : _promise{ promise }
+    {
+        _promise->_acquire();
+    }
+
+public:
+    using value_type = T;
+    using promise_type = promise<T>;
+
+    template<typename Other>
+    using rebind = task<Other>;
+
+    friend class promise_base<T>;
+    friend class detail::fan_in;
+    friend class detail::race;
+
+    class awaiter : detail::continuation
+    {
+    public:
+        awaiter(promise_base<T> * promise) : continuation{ nullptr, &_resume }, _promise{ promise }
+        {
+        }
+
+        // Continues the awaiting coroutine on resume_context, instead of the context it was running on.
+        awaiter(const task & t, execution_context & resume_context)
+            : continuation{ nullptr, &_resume }, _promise{ t._promise }, _resume_context{ &resume_context }
+        {
+        }
+
+        bool await_ready() const
+        {
+            return _promise->_state.is_ready()
+                && (!_resume_context || _resume_context == detail::this_thread_scheduling.context);
+        }
+
+        coro::coroutine_handle<> await_suspend(coro::coroutine_handle<> h)
+        {
+            auto & scheduling = detail::this_thread_scheduling;
+            handle = h;
+            context = _resume_context ? _resume_context : scheduling.context;
+            priority = scheduling.priority;
+
+            // Nothing may touch the awaited promise once the continuation is registered: it can complete,
+            // resume h and be destroyed on another thread before this function returns.
+            auto self = _promise->_self;
+            auto start = _promise->_try_start();
+
+            if (!_promise->_state.try_add_continuation(*this))
+            {
+                assert(!start);
+                if (context == scheduling.context)
+                {
+                    return h;
+                }
+
+                detail::enqueue(context, h);
+                return coro::noop_coroutine();
+            }
+
+            if (!start || _promise->_start_elsewhere(scheduling.context))
+            {
+                return coro::noop_coroutine();
+            }
+
+            if (scheduling.inline_depth >= detail::max_inline_depth)
+            {
+                detail::enqueue(scheduling.context, self);
+                return coro::noop_coroutine();
+            }
+
+            ++scheduling.inline_depth;
+            return self;
+        }
+
+        ::guilt::detail::replace_void_t<T> await_resume()
+        {
+            return _promise->_state.get_value();
+        }
+
+    private:
+        static coro::coroutine_handle<> _resume(continuation * self)
+        {
+            detail::enqueue(self->context, self->handle, self->priority);
+            return nullptr;
+        }
+
+        promise_base<T> * _promise;
+        execution_context * _resume_context = nullptr;
+    };
+
+    task() = delete;
+
+    ~task()
+    {
+        _release();
+    }
+
+    task(const task & other) : _promise{ other._promise }
+    {
+        _acquire();
+    }
+
+    task(task && other) : _promise{ std::exchange(other._promise, nullptr) }
+    {
+    }
+
+    task & operator=(const task & other)
+    {
+        if (this != &other)
+        {
+            _release();
+            _promise = other._promise;
+            _acquire();
+        }
+
+        return *this;
+    }
+
+    task & operator=(task && other)
+    {
+        if (this != &other)
+        {
+            _release();
+            _promise = std::exchange(other._promise, nullptr);
+        }
+
+        return *this;
+    }
+
+    bool is_ready() const
+    {
+        return _promise->_state.is_ready();
+    }
+
+    bool await_ready() const
+    {
+        return _promise->_state.is_ready();
+    }
+
+    awaiter operator co_await() const
+    {
+        return awaiter{ _promise };
+    }
+
+    ::guilt::detail::replace_void_t<T> await_resume()
+    {
+        return _promise->_state.get_value();
+    }
+
+    // Starts the task on the context it is bound to, if any, and otherwise on the context running on this
+    // thread, or the global one when there is none. Unless it was given a priority of its own, it runs at the
+    // priority of the job starting it.
+    void start()
+    {
+        if (_promise->_try_start())
+        {
+            auto ctx = _promise->_context ? _promise->_context : execution_context::current();
+            auto priority = _promise->_priority.value_or(execution_context::current_priority());
+            detail::enqueue(ctx, _promise->_self, priority);
+        }
+    }
+
+    void start(execution_context & ctx)
+    {
+        set_execution_context(ctx);
+        start();
+    }
+
+    void start(task_priority priority)
+    {
+        set_priority(priority);
+        start();
+    }
+
+    // Has to happen before the task is started or shared with other threads, like set_execution_context.
+    void set_priority(task_priority priority)
+    {
+        _promise->set_priority(priority);
+    }
+
+    // Binds the task to ctx, so that it gets started there no matter who starts it: start(), an awaiter, or
+    // when_all and when_any. Has to happen before the task is started or shared with other threads.
+    void set_execution_context(execution_context & ctx)
+    {
+        _promise->_context = &ctx;
+    }
+
+    // Has to happen before the task is started or shared with other threads. Without a token of its own, the
+    // task takes over the token of the first task that awaits it, if that one has any.
+    void set_cancellation_token(cancellation_token token)
+    {
+        _promise->set_cancellation_token(std::move(token));
+    }
+
+    void inherit_cancellation(const cancellation_token & token) const
+    {
+        _promise->inherit_cancellation(token);
+    }
+
+private:
+    promise_base<T> * _promise;
+
+    void _acquire()
+    {
+        assert(_promise);
+        _promise->_acquire();
+    }
+
+    void _release()
+    {
+        if (!_promise)
+        {
+            return;
+        }
+
+        std::exchange(_promise, nullptr)->_release();
+    }
+};
+
+template<typename T = void>
+task<T> make_ready_task(::guilt::detail::replace_void_t<T> val = {})
+{
+    auto ret = [val = std::move(val)]() mutable -> task<T> { co_return std::move(val); };
+    ret.start();
+    return ret;
+}
+
+// Moves the awaiting coroutine over to ctx: it continues as a job of ctx from then on, including whatever it
+// resumes inline. Does nothing if it is already running on ctx.
+inline auto schedule_on(execution_context & ctx)
+{
+    struct awaitable
+    {
+        bool await_ready() const
+        {
+            return execution_context::current() == ctx;
+        }
+
+        void await_suspend(coro::coroutine_handle<> h) const
+        {
+            ctx->get_executor().schedule(h);
+        }
+
+        void await_resume() const
+        {
+        }
+
+        execution_context * ctx;
+    };
+
+    return awaitable{ &ctx };
+}
+
+namespace detail
+{
+    template<typename T>
+    class resume_on_awaitable
+    {
+    public:
+        resume_on_awaitable(execution_context & ctx, task<T> t) : _context{ &ctx }, _task{ std::move(t) }
+        {
+        }
+
+        auto operator co_await() const
+        {
+            return typename task<T>::awaiter{ _task, *_context };
+        }
+
+        void inherit_cancellation(const cancellation_token & token) const
+        {
+            _task.inherit_cancellation(token);
+        }
+
+    private:
+        execution_context * _context;
+        task<T> _task;
+    };
+}
+
+// Awaits t, then continues the awaiting coroutine on ctx, wherever t completes.
+template<typename T>
+detail::resume_on_awaitable<T> resume_on(execution_context & ctx, task<T> t)
+{
+    return { ctx, std::move(t) };
+}
+
+namespace detail
+{
+    // The completion side of when_all. Every input gets a continuation that counts _remaining down, and the
+    // one that brings it to zero resumes the awaiting coroutine - once, however many inputs there are. The
+    // awaiter holds an extra count while it registers the continuations, so that inputs finishing early
+    // cannot resume it before it is done suspending.
+    class fan_in
+    {
+    public:
+        fan_in() = default;
+
+        // Awaiters are only moved before they are awaited, while there is no count to carry over.
+        fan_in(fan_in &&)
+        {
+        }
+
+    protected:
+        struct input : continuation
+        {
+            input() : continuation{ nullptr, &_arrive }
+            {
+            }
+
+            fan_in * owner = nullptr;
+        };
+
+        void _begin(coro::coroutine_handle<> h, std::size_t count)
+        {
+            _awaiting = h;
+            _context = this_thread_scheduling.context;
+            _priority = this_thread_scheduling.priority;
+            _remaining.store(count + 1, std::memory_order_relaxed);
+        }
+
+        // Starts t if nobody did yet and registers c on it. The first input started here is left for _finish
+        // to run; the others are queued right away.
+        template<typename T>
+        void _add(const task<T> & t, input & c)
+        {
+            auto promise = t._promise;
+            auto self = promise->_self;
+            auto start = promise->_try_start();
+
+            c.owner = this;
+            c.priority = _priority;
+            if (!promise->_state.try_add_continuation(c))
+            {
+                assert(!start);
+                _remaining.fetch_sub(1, std::memory_order_relaxed);
+                return;
+            }
+
+            if (start && !promise->_start_elsewhere(_context))
+            {
+                if (_to_run)
+                {
+                    enqueue(_context, self);
+                }
+                else
+                {
+                    _to_run = self;
+                }
+            }
+        }
+
+        // Drops the count held during registration. Nothing may touch this object afterwards, unless that
+        // was the last count: the inputs can complete and resume the awaiting coroutine on another thread.
+        coro::coroutine_handle<> _finish()
+        {
+            auto awaiting = _awaiting;
+            auto context = _context;
+            auto to_run = _to_run;
+
+            if (_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                assert(!to_run);
+                return awaiting;
+            }
+
+            if (!to_run)
+            {
+                return coro::noop_coroutine();
+            }
+
+            auto & scheduling = this_thread_scheduling;
+            if (scheduling.inline_depth >= max_inline_depth)
+            {
+                enqueue(context, to_run);
+                return coro::noop_coroutine();
+            }
+
+            ++scheduling.inline_depth;
+            return to_run;
+        }
+
+    private:
+        // The last input to complete continues the awaiting coroutine, directly if it completed on the same
+        // context.
+        static coro::coroutine_handle<> _arrive(continuation * c)
+        {
+            auto owner = static_cast<input *>(c)->owner;
+            if (owner->_remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            {
+                return nullptr;
+            }
+
+            if (owner->_context == this_thread_scheduling.context)
+            {
+                return owner->_awaiting;
+            }
+
+            enqueue(owner->_context, owner->_awaiting, owner->_priority);
+            return nullptr;
+        }
+
+        std::atomic<std::size_t> _remaining = 0;
+        coro::coroutine_handle<> _awaiting = nullptr;
+        execution_context * _context = nullptr;
+        task_priority _priority = task_priority::normal;
+        coro::coroutine_handle<> _to_run = nullptr;
+    };
+
+    template<typename... Ts>
+    class when_all_awaiter : fan_in
+    {
+    public:
+        using value_type = std::tuple<replace_void_t<Ts>...>;
+
+        when_all_awaiter(task<Ts> &... tasks) : _tasks{ tasks... }
+        {
+        }
+
+        void inherit_cancellation(const cancellation_token & token) const
+        {
+            std::apply([&](auto &... ts) { (ts.inherit_cancellation(token), ...); }, _tasks);
+        }
+
+        bool await_ready() const
+        {
+            return std::apply([](auto &... ts) { return (ts.is_ready() && ...); }, _tasks);
+        }
+
+        coro::coroutine_handle<> await_suspend(coro::coroutine_handle<> h)
+        {
+            _begin(h, sizeof...(Ts));
+            [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+                (_add(std::get<Is>(_tasks), _inputs[Is]), ...);
+            }(std::index_sequence_for<Ts...>());
+            return _finish();
+        }
+
+        value_type await_resume()
+        {
+            return std::apply([](auto &... ts) { return value_type{ ts.await_resume()... }; }, _tasks);
+        }
+
+    private:
+        std::tuple<task<Ts> &...> _tasks;
+        std::array<input, sizeof...(Ts)> _inputs;
+    };
+
+    template<typename T>
+    class when_all_range_awaiter : fan_in
+    {
+    public:
+        using value_type = std::vector<replace_void_t<T>>;
+
+        when_all_range_awaiter(std::vector<task<T>> & tasks) : _tasks{ tasks }
+        {
+        }
+
+        void inherit_cancellation(const cancellation_token & token) const
+        {
+            for (auto && t : _tasks)
+            {
+                t.inherit_cancellation(token);
+            }
+        }
+
+        bool await_ready() const
+        {
+            return std::all_of(_tasks.begin(), _tasks.end(), [](auto && t) { return t.is_ready(); });
+        }
+
+        coro::coroutine_handle<> await_suspend(coro::coroutine_handle<> h)
+        {
+            _inputs = std::make_unique<input[]>(_tasks.size());
+            _begin(h, _tasks.size());
+            for (std::size_t i = 0; i < _tasks.size(); ++i)
+            {
+                _add(_tasks[i], _inputs[i]);
+            }
+            return _finish();
+        }
+
+        value_type await_resume()
+        {
+            value_type values;
+            values.reserve(_tasks.size());
+            for (auto && t : _tasks)
+            {
+                values.push_back(t.await_resume());
+            }
+            return values;
+        }
+
+    private:
+        std::vector<task<T>> & _tasks;
+        std::unique_ptr<input[]> _inputs;
+    };
+}
+
+// Starts all of the tasks at once and completes when every one of them has; the results are collected in
+// order, and the first input that failed, if any, has its exception rethrown.
+template<typename... Ts>
+task<std::tuple<::guilt::detail::replace_void_t<Ts>...>> when_all(task<Ts>... ts)
+{
+    co_return co_await detail::when_all_awaiter<Ts...>{ ts... };
+}
+
+template<typename T>
+task<std::vector<::guilt::detail::replace_void_t<T>>> when_all(std::vector<task<T>> ts)
+{
+    co_return co_await detail::when_all_range_awaiter<T>{ ts };
+}
+
+// The outcome of when_any: the position of the input that completed first, and its result.
+template<typename T>
+struct when_any_result
+{
+    std::size_t index;
+    T value;
+};
+
+namespace detail
+{
+    // The completion side of when_any. The first input to complete wins and resumes the awaiting coroutine.
+    // The others keep their continuations registered until they complete as well, possibly long after the
+    // awaiter is gone, so the race lives on the heap, with a reference for every input and one for the
+    // awaiter. _gate works like fan_in's count, with the winner as the only input that counts. Inputs without
+    // a cancellation token of their own get one that the winner cancels, on top of the awaiter's.
+    class race
+    {
+    public:
+        static constexpr std::size_t no_winner = std::numeric_limits<std::size_t>::max();
+
+        race(std::size_t count, coro::coroutine_handle<> awaiting, const cancellation_token * parent)
+            : _losers{ parent ? cancellation_source{ *parent } : cancellation_source{} },
+              _references{ count + 1 },
+              _inputs{ std::make_unique<input[]>(count) },
+              _awaiting{ awaiting },
+              _context{ this_thread_scheduling.context },
+              _priority{ this_thread_scheduling.priority }
+        {
+        }
+
+        race(const race &) = delete;
+        race & operator=(const race &) = delete;
+
+        bool decided() const
+        {
+            return _winner.load(std::memory_order_acquire) != no_winner;
+        }
+
+        std::size_t winner() const
+        {
+            return _winner.load(std::memory_order_acquire);
+        }
+
+        // Starts t if nobody did yet and registers the index-th continuation on it, the same way fan_in does.
+        template<typename T>
+        void add(std::size_t index, const task<T> & t)
+        {
+            auto & c = _inputs[index];
+            c.owner = this;
+            c.index = index;
+            c.priority = _priority;
+
+            auto promise = t._promise;
+            auto self = promise->_self;
+            promise->inherit_cancellation(_losers_token);
+            auto start = promise->_try_start();
+
+            if (!promise->_state.try_add_continuation(c))
+            {
+                assert(!start);
+                _arrive_at(index);
+                release();
+                return;
+            }
+
+            if (start && !promise->_start_elsewhere(_context))
+            {
+                if (_to_run)
+                {
+                    enqueue(_context, self);
+                }
+                else
+                {
+                    _to_run = self;
+                }
+            }
+        }
+
+        // Drops the reference of an input that is not added, because the race was decided before its turn.
+        // Such inputs are never started by the race.
+        void skip()
+        {
+            release();
+        }
+
+        coro::coroutine_handle<> finish()
+        {
+            auto awaiting = _awaiting;
+            auto context = _context;
+            auto to_run = _to_run;
+
+            if (_gate.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                if (to_run)
+                {
+                    enqueue(context, to_run);
+                }
+                return awaiting;
+            }
+
+            if (!to_run)
+            {
+                return coro::noop_coroutine();
+            }
+
+            auto & scheduling = this_thread_scheduling;
+            if (scheduling.inline_depth >= max_inline_depth)
+            {
+                enqueue(context, to_run);
+                return coro::noop_coroutine();
+            }
+
+            ++scheduling.inline_depth;
+            return to_run;
+        }
+
+        void release()
+        {
+            if (_references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                delete this;
+            }
+        }
+
+    private:
+        struct input : continuation
+        {
+            input() : continuation{ nullptr, &_arrive }
+            {
+            }
+
+            race * owner = nullptr;
+            std::size_t index = 0;
+        };
+
+        // Returns true if the awaiter is to be resumed by the caller.
+        bool _arrive_at(std::size_t index)
+        {
+            auto expected = no_winner;
+            if (!_winner.compare_exchange_strong(expected, index, std::memory_order_acq_rel))
+            {
+                return false;
+            }
+
+            _losers.cancel();
+            return _gate.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        }
+
+        static coro::coroutine_handle<> _arrive(continuation * c)
+        {
+            auto arrived = static_cast<input *>(c);
+            auto owner = arrived->owner;
+            auto awaiting = owner->_awaiting;
+            auto context = owner->_context;
+            auto priority = owner->_priority;
+
+            auto resume = owner->_arrive_at(arrived->index);
+            owner->release();
+
+            if (!resume)
+            {
+                return nullptr;
+            }
+
+            if (context == this_thread_scheduling.context)
+            {
+                return awaiting;
+            }
+
+            enqueue(context, awaiting, priority);
+            return nullptr;
+        }
+
+        cancellation_source _losers;
+        cancellation_token _losers_token = _losers.get_token();
+        std::atomic<std::size_t> _references;
+        std::atomic<std::size_t> _winner = no_winner;
+        std::atomic<std::size_t> _gate = 2;
+        std::unique_ptr<input[]> _inputs;
+        coro::coroutine_handle<> _awaiting;
+        execution_context * _context;
+        task_priority _priority;
+        coro::coroutine_handle<> _to_run = nullptr;
+    };
+
+    // Holds the awaiter's reference to a race, which lasts until the result has been read.
+    class race_reference
+    {
+    public:
+        race_reference() = default;
+
+        race_reference(race_reference && other) : _race{ std::exchange(other._race, nullptr) }
+        {
+        }
+
+        ~race_reference()
+        {
+            if (_race)
+            {
+                _race->release();
+            }
+        }
+
+        race * get() const
+        {
+            return _race;
+        }
+
+        void reset(race * r)
+        {
+            assert(!_race);
+            _race = r;
+        }
+
+    private:
+        race * _race = nullptr;
+    };
+
+    template<typename... Ts>
+    class when_any_awaiter
+    {
+        using variant_type = std::variant<replace_void_t<Ts>...>;
+
+    public:
+        using value_type = when_any_result<variant_type>;
+
+        when_any_awaiter(task<Ts> &... tasks) : _tasks{ tasks... }
+        {
+        }
+
+        void inherit_cancellation(const cancellation_token & token)
+        {
+            _cancellation = &token;
+        }
+
+        bool await_ready() const
+        {
+            return _first_ready() != race::no_winner;
+        }
+
+        coro::coroutine_handle<> await_suspend(coro::coroutine_handle<> h)
+        {
+            _race.reset(new race{ sizeof...(Ts), h, _cancellation });
+            _for_each_input(
+                [&](std::size_t index, auto & t)
+                {
+                    if (_race.get()->decided())
+                    {
+                        _race.get()->skip();
+                    }
+                    else
+                    {
+                        _race.get()->add(index, t);
+                    }
+                });
+            return _race.get()->finish();
+        }
+
+        value_type await_resume()
+        {
+            auto winner = _race.get() ? _race.get()->winner() : _first_ready();
+
+            std::optional<value_type> result;
+            _for_each_input(
+                [&]<std::size_t I>(std::integral_constant<std::size_t, I>, auto & t)
+                {
+                    if (I == winner)
+                    {
+                        result.emplace(
+                            value_type{ I, variant_type{ std::in_place_index<I>, t.await_resume() } });
+                    }
+                });
+            return std::move(*result);
+        }
+
+    private:
+        template<typename F>
+        void _for_each_input(F && f) const
+        {
+            [&]<std::size_t... Is>(std::index_sequence<Is...>) {
+                (f(std::integral_constant<std::size_t, Is>(), std::get<Is>(_tasks)), ...);
+            }(std::index_sequence_for<Ts...>());
+        }
+
+        std::size_t _first_ready() const
+        {
+            auto first = race::no_winner;
+            _for_each_input(
+                [&](std::size_t index, auto & t)
+                {
+                    if (first == race::no_winner && t.is_ready())
+                    {
+                        first = index;
+                    }
+                });
+            return first;
+        }
+
+        std::tuple<task<Ts> &...> _tasks;
+        race_reference _race;
+        const cancellation_token * _cancellation = nullptr;
+    };
+
+    template<typename T>
+    class when_any_range_awaiter
+    {
+    public:
+        using value_type = when_any_result<replace_void_t<T>>;
+
+        when_any_range_awaiter(std::vector<task<T>> & tasks) : _tasks{ tasks }
+        {
+        }
+
+        void inherit_cancellation(const cancellation_token & token)
+        {
+            _cancellation = &token;
+        }
+
+        bool await_ready() const
+        {
+            return _first_ready() != race::no_winner;
+        }
+
+        coro::coroutine_handle<> await_suspend(coro::coroutine_handle<> h)
+        {
+            _race.reset(new race{ _tasks.size(), h, _cancellation });
+            for (std::size_t i = 0; i < _tasks.size(); ++i)
+            {
+                if (_race.get()->decided())
+                {
+                    _race.get()->skip();
+                }
+                else
+                {
+                    _race.get()->add(i, _tasks[i]);
+                }
+            }
+            return _race.get()->finish();
+        }
+
+        value_type await_resume()
+        {
+            auto winner = _race.get() ? _race.get()->winner() : _first_ready();
+            return value_type{ winner, _tasks[winner].await_resume() };
+        }
+
+    private:
+        std::size_t _first_ready() const
+        {
+            auto it = std::find_if(_tasks.begin(), _tasks.end(), [](auto && t) { return t.is_ready(); });
+            return it == _tasks.end() ? race::no_winner : it - _tasks.begin();
+        }
+
+        std::vector<task<T>> & _tasks;
+        race_reference _race;
+        const cancellation_token * _cancellation = nullptr;
+    };
+}
+
+// Starts the tasks and completes as soon as the first of them does, with that task's index and result; if it
+// failed, its exception is rethrown instead. The other tasks are detached: the ones the race did not get to
+// start before it was decided are never started, and the ones already running carry on, with their results
+// discarded. Those of them that had no cancellation token of their own before the race are cancelled, so they
+// stop at their next cancellation point; a task that is also awaited elsewhere should be given a token first.
+template<typename... Ts>
+task<when_any_result<std::variant<::guilt::detail::replace_void_t<Ts>...>>> when_any(task<Ts>... ts)
+{
+    static_assert(sizeof...(Ts) > 0, "when_any needs at least one task to wait for");
+    co_return co_await detail::when_any_awaiter<Ts...>{ ts... };
+}
+
+template<typename T>
+task<when_any_result<::guilt::detail::replace_void_t<T>>> when_any(std::vector<task<T>> ts)
+{
+    if (ts.empty())
+    {
+        throw std::invalid_argument{ "when_any needs at least one task to wait for" };
+    }
+
+    co_return co_await detail::when_any_range_awaiter<T>{ ts };
 }
 }
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "tasking.h"
+
+namespace guilt
+{
+class thread_pool_execution_context;
+
+namespace detail
+{
+    struct pool_worker_binding
+    {
+        const thread_pool_execution_context * pool = nullptr;
+        std::size_t index = 0;
+    };
+
+    inline thread_local pool_worker_binding current_pool_worker;
+}
+
+class thread_pool_execution_context : public execution_context
+{
+public:
+    explicit thread_pool_execution_context(std::size_t thread_count = std::thread::hardware_concurrency())
+        : _thread_count{ std::max<std::size_t>(thread_count, 1) },
+          _queues{ std::make_unique<worker_queue[]>(_thread_count) }
+    {
+        _threads.reserve(_thread_count);
+        for (std::size_t i = 0; i < _thread_count; ++i)
+        {
+            _threads.emplace_back([this, i] { _worker_loop(i); });
+        }
+    }
+
+    // Jobs that have not been picked up by the time the context is destroyed are discarded, the same way they
+    // are when a single threaded execution_context goes away.
+    ~thread_pool_execution_context() override
+    {
+        {
+            std::lock_guard<std::mutex> lock{ _sleep_mutex };
+            _stopping = true;
+        }
+        _wakeup.notify_all();
+
+        for (auto && thread : _threads)
+        {
+            thread.join();
+        }
+    }
+
+    std::size_t thread_count() const
+    {
+        return _thread_count;
+    }
+
+protected:
+    void _enqueue(Callback cb, task_priority priority) override
+    {
+        _push(std::move(cb), priority);
+    }
+
+    void _enqueue(coro::coroutine_handle<> h, task_priority priority) override
+    {
+        _push(h, priority);
+    }
+
+    // Threads that are not workers of this pool help out while they wait, but since work that is in flight on
+    // a worker may still produce more, the context is only idle once every job that was queued has finished.
+    bool _handle_one() override
+    {
+        if (auto next = _take(_local_index()))
+        {
+            _run_counted(*next);
+            return true;
+        }
+
+        if (_pending.load() == 0)
+        {
+            return false;
+        }
+
+        std::this_thread::yield();
+        return true;
+    }
+
+private:
+    static constexpr std::size_t no_worker = std::numeric_limits<std::size_t>::max();
+
+    struct alignas(64) worker_queue
+    {
+        std::mutex mutex;
+        ready_queue jobs;
+    };
+
+    template<typename Job>
+    void _push(Job && j, task_priority priority)
+    {
+        _pending.fetch_add(1);
+        _queued.fetch_add(1);
+
+        auto index = _local_index();
+        if (index != no_worker)
+        {
+            std::lock_guard<std::mutex> lock{ _queues[index].mutex };
+            _queues[index].jobs.push_back(std::forward<Job>(j), priority);
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock{ _injection_mutex };
+            _injected.push_back(std::forward<Job>(j), priority);
+        }
+
+        if (_sleeping.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock{ _sleep_mutex };
+            _wakeup.notify_one();
+        }
+    }
+
+    std::size_t _local_index() const
+    {
+        auto & binding = detail::current_pool_worker;
+        return binding.pool == this ? binding.index : no_worker;
+    }
+
+    // Owners pop the most recently pushed job from their own queue, while everybody else takes the oldest
+    // one: first from the injection queue, then by stealing from the other workers.
+    std::optional<job> _take(std::size_t index)
+    {
+        if (_queued.load() == 0)
+        {
+            return std::nullopt;
+        }
+
+        if (index != no_worker)
+        {
+            std::lock_guard<std::mutex> lock{ _queues[index].mutex };
+            if (!_queues[index].jobs.empty())
+            {
+                _queued.fetch_sub(1);
+                return _queues[index].jobs.pop_back();
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{ _injection_mutex };
+            if (!_injected.empty())
+            {
+                _queued.fetch_sub(1);
+                return _injected.pop_front();
+            }
+        }
+
+        auto start = index == no_worker ? _next_victim.fetch_add(1, std::memory_order_relaxed) : index + 1;
+        for (std::size_t i = 0; i < _thread_count; ++i)
+        {
+            auto victim = (start + i) % _thread_count;
+            if (victim == index)
+            {
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock{ _queues[victim].mutex, std::try_to_lock };
+            if (lock && !_queues[victim].jobs.empty())
+            {
+                _queued.fetch_sub(1);
+                return _queues[victim].jobs.pop_front();
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    void _run_counted(job & j)
+    {
+        try
+        {
+            _run(j);
+        }
+        catch (...)
+        {
+            _pending.fetch_sub(1);
+            throw;
+        }
+
+        _pending.fetch_sub(1);
+    }
+
+    void _worker_loop(std::size_t index)
+    {
+        detail::current_pool_worker = { this, index };
+
+        while (true)
+        {
+            if (auto next = _take(index))
+            {
+                _run_counted(*next);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock{ _sleep_mutex };
+            _sleeping.fetch_add(1);
+            _wakeup.wait(lock, [&] { return _stopping || _queued.load() > 0; });
+            _sleeping.fetch_sub(1);
+
+            if (_stopping)
+            {
+                return;
+            }
+        }
+    }
+
+    std::size_t _thread_count;
+    std::unique_ptr<worker_queue[]> _queues;
+
+    std::mutex _injection_mutex;
+    ready_queue _injected;
+
+    // _queued counts jobs sitting in any of the queues; _pending also includes the ones that are running.
+    std::atomic<std::size_t> _queued = 0;
+    std::atomic<std::size_t> _pending = 0;
+    std::atomic<std::size_t> _next_victim = 0;
+
+    std::mutex _sleep_mutex;
+    std::condition_variable _wakeup;
+    std::atomic<std::size_t> _sleeping = 0;
+    bool _stopping = false;
+
+    std::vector<std::thread> _threads;
+};
+}